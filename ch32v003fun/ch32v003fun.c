@@ -108,9 +108,30 @@ int wctomb(char *s, wchar_t wc)
 	if (!s) return 0;
 	return wcrtomb(s, wc, 0);
 }
-size_t strlen(const char *s) { const char *a = s;for (; *s; s++);return s-a; }
+// The scanning functions look at a word at a time once aligned.  HASZERO is
+// nonzero if any byte of x is 0; xor with a byte repeated 4 times to look for
+// that byte instead.  Reading the rest of the aligned word past the end of a
+// string is harmless here; there's no MMU to fault on it.
+#define SWAR_ONES  ((uint32_t)0x01010101)
+#define SWAR_HIGHS ((uint32_t)0x80808080)
+#define SWAR_HASZERO(x) (((x)-SWAR_ONES) & ~(x) & SWAR_HIGHS)
+
+static inline uint32_t SwarRepeat(unsigned char c)
+{
+	uint32_t k = c | (c << 8); // No multiply on rv32ec.
+	return k | (k << 16);
+}
+
+size_t strlen(const char *s)
+{
+	const char *a = s;
+	const uint32_t *w;
+	for (; (uintptr_t)s & 3; s++) if (!*s) return s-a;
+	for (w = (const void *)s; !SWAR_HASZERO(*w); w++);
+	for (s = (const void *)w; *s; s++);
+	return s-a;
+}
 size_t strnlen(const char *s, size_t n) { const char *p = memchr(s, 0, n); return p ? p-s : n;}
-void *memset(void *dest, int c, size_t n) { unsigned char *s = dest; for (; n; n--, s++) *s = c; return dest; }
 char *strcpy(char *d, const char *s) { for (; (*d=*s); s++, d++); return d; }
 char *strncpy(char *d, const char *s, size_t n) { for (; n && (*d=*s); n--, s++, d++); return d; }
 int strcmp(const char *l, const char *r)
@@ -278,14 +299,26 @@ char *strstr(const char *h, const char *n)
 	return twoway_strstr((void *)h, (void *)n);
 }
 
-char *strchr(const char *s, int c)
+static char *__strchrnul(const char *s, int c)
 {
+	const uint32_t *w;
+	uint32_t k;
 	c = (unsigned char)c;
 	if (!c) return (char *)s + strlen(s);
-	for (; *s && *(unsigned char *)s != c; s++);
+	for (; (uintptr_t)s & 3; s++)
+		if (!*s || *(unsigned char *)s == c) return (char *)s;
+	k = SwarRepeat(c);
+	for (w = (const void *)s; !SWAR_HASZERO(*w) && !SWAR_HASZERO(*w ^ k); w++);
+	for (s = (const void *)w; *s && *(unsigned char *)s != c; s++);
 	return (char *)s;
 }
 
+char *strchr(const char *s, int c)
+{
+	char *r = __strchrnul(s, c);
+	return *(unsigned char *)r == (unsigned char)c ? r : 0;
+}
+
 
 void *__memrchr(const void *m, int c, size_t n)
 {
@@ -300,14 +333,67 @@ char *strrchr(const char *s, int c)
 	return __memrchr(s, c, strlen(s) + 1);
 }
 
+// memcpy, memset and memmove move whole words where they can.  The core can't
+// do misaligned word accesses, so heads and tails go a byte at a time, and if
+// source and destination don't line up, memcpy stitches aligned loads together
+// with shifts.  Build with -DSMALL_MEMFUNCS to drop the unrolling and the
+// shifting, for smaller code that's still word-at-a-time when aligned.
 void *memcpy(void *dest, const void *src, size_t n)
 {
 	unsigned char *d = dest;
 	const unsigned char *s = src;
+
+	if (n >= 8) {
+		for (; (uintptr_t)d & 3; n--) *d++ = *s++;
+		uint32_t *dw = (uint32_t *)d;
+		if (((uintptr_t)s & 3) == 0) {
+			const uint32_t *sw = (const uint32_t *)s;
+#ifndef SMALL_MEMFUNCS
+			for (; n >= 16; n -= 16, dw += 4, sw += 4) {
+				dw[0] = sw[0]; dw[1] = sw[1]; dw[2] = sw[2]; dw[3] = sw[3];
+			}
+#endif
+			for (; n >= 4; n -= 4) *dw++ = *sw++;
+			s = (const unsigned char *)sw;
+		}
+#ifndef SMALL_MEMFUNCS
+		else {
+			// Never reads past the aligned word holding the last byte needed.
+			unsigned sh = ((uintptr_t)s & 3) * 8;
+			const uint32_t *sw = (const uint32_t *)((uintptr_t)s & ~3);
+			uint32_t w = *sw++;
+			for (; n >= 4; n -= 4, s += 4) {
+				uint32_t next = *sw++;
+				*dw++ = (w >> sh) | (next << (32 - sh));
+				w = next;
+			}
+		}
+#endif
+		d = (unsigned char *)dw;
+	}
 	for (; n; n--) *d++ = *s++;
 	return dest;
 }
 
+void *memset(void *dest, int c, size_t n)
+{
+	unsigned char *s = dest;
+	for (; n && ((uintptr_t)s & 3); n--) *s++ = c;
+	if (n >= 4) {
+		uint32_t *w = (uint32_t *)s;
+		uint32_t c32 = (unsigned char)c;
+		c32 |= c32 << 8; // No multiply on rv32ec.
+		c32 |= c32 << 16;
+#ifndef SMALL_MEMFUNCS
+		for (; n >= 16; n -= 16, w += 4) w[0] = w[1] = w[2] = w[3] = c32;
+#endif
+		for (; n >= 4; n -= 4) *w++ = c32;
+		s = (unsigned char *)w;
+	}
+	for (; n; n--) *s++ = c;
+	return dest;
+}
+
 int memcmp(const void *vl, const void *vr, size_t n)
 {
 	const unsigned char *l=vl, *r=vr;
@@ -322,13 +408,14 @@ void *memmove(void *dest, const void *src, size_t n)
 	const char *s = src;
 
 	if (d==s) return d;
-	if ((uintptr_t)s-(uintptr_t)d-n <= -2*n) return memcpy(d, s, n);
+	// memcpy only ever works upwards, so it's also safe when d is below s.
+	if ((uintptr_t)s-(uintptr_t)d-n <= -2*n || d<s) return memcpy(d, s, n);
 
-	if (d<s) {
-		for (; n; n--) *d++ = *s++;
-	} else {
-		while (n) n--, d[n] = s[n];
+	if ((((uintptr_t)d ^ (uintptr_t)s) & 3) == 0) {
+		while (n && ((uintptr_t)(d+n) & 3)) n--, d[n] = s[n];
+		while (n >= 4) n -= 4, *(uint32_t *)(d+n) = *(const uint32_t *)(s+n);
 	}
+	while (n) n--, d[n] = s[n];
 
 	return dest;
 }
@@ -336,6 +423,13 @@ void *memchr(const void *src, int c, size_t n)
 {
 	const unsigned char *s = src;
 	c = (unsigned char)c;
+	for (; ((uintptr_t)s & 3) && n && *s != c; s++, n--);
+	if (n && *s != c) {
+		const uint32_t *w;
+		uint32_t k = SwarRepeat(c);
+		for (w = (const void *)s; n >= 4 && !SWAR_HASZERO(*w ^ k); w++, n -= 4);
+		s = (const void *)w;
+	}
 	for (; n && *s != c; s++, n--);
 	return n ? (void *)s : 0;
 }
@@ -393,45 +487,56 @@ int puts(const char *s)
 
 #define mini_strlen strlen
 
+/* There's no divide on rv32ec, so base 10 subtracts powers of ten, and the
+ * power of 2 radices are done with shifts and masks. */
+static const unsigned long mini_pow10[9] = {
+	1000000000, 100000000, 10000000, 1000000, 100000, 10000, 1000, 100, 10 };
+
 static int
 mini_itoa(long value, unsigned int radix, int uppercase, int unsig,
 	 char *buffer)
 {
 	char	*pbuffer = buffer;
-	int	negative = 0;
-	int	i, len;
-
-	/* No support for unusual radixes. */
-	if (radix > 16)
-		return 0;
+	unsigned long u = value;
+	int	i;
 
 	if (value < 0 && !unsig) {
-		negative = 1;
-		value = -value;
+		*(pbuffer++) = '-';
+		u = -(unsigned long)value;
 	}
 
-	/* This builds the string back to front ... */
-	do {
-		int digit = value % radix;
-		*(pbuffer++) = (digit < 10 ? '0' + digit : (uppercase ? 'A' : 'a') + digit - 10);
-		value /= radix;
-	} while (value > 0);
-
-	if (negative)
-		*(pbuffer++) = '-';
+	if (radix == 10) {
+		/* Digits come out front to back, so there's nothing to reverse. */
+		int started = 0;
+		for (i = 0; i < 9; i++) {
+			char digit = '0';
+			while (u >= mini_pow10[i]) {
+				u -= mini_pow10[i];
+				digit++;
+			}
+			started |= (digit != '0');
+			if (started)
+				*(pbuffer++) = digit;
+		}
+		*(pbuffer++) = '0' + u;
+	} else if (radix >= 2 && radix <= 16 && !(radix & (radix - 1))) {
+		int bits = 1, shift = 0;
+		while ((1u << bits) < radix)
+			bits++;
+		while ((u >> shift) >> bits)
+			shift += bits;
+		for (; shift >= 0; shift -= bits) {
+			int digit = (u >> shift) & (radix - 1);
+			*(pbuffer++) = (digit < 10 ? '0' + digit : (uppercase ? 'A' : 'a') + digit - 10);
+		}
+	} else {
+		/* No support for unusual radixes. */
+		return 0;
+	}
 
 	*(pbuffer) = '\0';
 
-	/* ... now we reverse it (could do it recursively but will
-	 * conserve the stack space) */
-	len = (pbuffer - buffer);
-	for (i = 0; i < len / 2; i++) {
-		char j = buffer[i];
-		buffer[i] = buffer[len-i-1];
-		buffer[len-i-1] = j;
-	}
-
-	return len;
+	return pbuffer - buffer;
 }
 
 static int
@@ -691,14 +796,26 @@ void AWU_IRQHandler( void )              __attribute__((section(".text.vector_ha
 void DMA1_Channel1_IRQHandler( void )    __attribute__((section(".text.vector_handler"))) __attribute((weak,alias("DefaultIRQHandler"))) __attribute__((used));
 void DMA1_Channel2_IRQHandler( void )    __attribute__((section(".text.vector_handler"))) __attribute((weak,alias("DefaultIRQHandler"))) __attribute__((used));
 void DMA1_Channel3_IRQHandler( void )    __attribute__((section(".text.vector_handler"))) __attribute((weak,alias("DefaultIRQHandler"))) __attribute__((used));
+#if defined( STDOUT_UART ) && defined( UART_DMA_TX )
+void DMA1_Channel4_IRQHandler( void )    __attribute__((interrupt)); // Buffered stdout, below.
+#else
 void DMA1_Channel4_IRQHandler( void )    __attribute__((section(".text.vector_handler"))) __attribute((weak,alias("DefaultIRQHandler"))) __attribute__((used));
+#endif
+#ifdef UART_DMA_RX
+void DMA1_Channel5_IRQHandler( void )    __attribute__((interrupt)); // Buffered UART input, below.
+#else
 void DMA1_Channel5_IRQHandler( void )    __attribute__((section(".text.vector_handler"))) __attribute((weak,alias("DefaultIRQHandler"))) __attribute__((used));
+#endif
 void DMA1_Channel6_IRQHandler( void )    __attribute__((section(".text.vector_handler"))) __attribute((weak,alias("DefaultIRQHandler"))) __attribute__((used));
 void DMA1_Channel7_IRQHandler( void )    __attribute__((section(".text.vector_handler"))) __attribute((weak,alias("DefaultIRQHandler"))) __attribute__((used));
 void ADC1_IRQHandler( void )             __attribute__((section(".text.vector_handler"))) __attribute((weak,alias("DefaultIRQHandler"))) __attribute__((used));
 void I2C1_EV_IRQHandler( void )          __attribute__((section(".text.vector_handler"))) __attribute((weak,alias("DefaultIRQHandler"))) __attribute__((used));
 void I2C1_ER_IRQHandler( void )          __attribute__((section(".text.vector_handler"))) __attribute((weak,alias("DefaultIRQHandler"))) __attribute__((used));
+#ifdef UART_DMA_RX
+void USART1_IRQHandler( void )           __attribute__((interrupt)); // Buffered UART input, below.
+#else
 void USART1_IRQHandler( void )           __attribute__((section(".text.vector_handler"))) __attribute((weak,alias("DefaultIRQHandler"))) __attribute__((used));
+#endif
 void SPI1_IRQHandler( void )             __attribute__((section(".text.vector_handler"))) __attribute((weak,alias("DefaultIRQHandler"))) __attribute__((used));
 void TIM1_BRK_IRQHandler( void )         __attribute__((section(".text.vector_handler"))) __attribute((weak,alias("DefaultIRQHandler"))) __attribute__((used));
 void TIM1_UP_IRQHandler( void )          __attribute__((section(".text.vector_handler"))) __attribute((weak,alias("DefaultIRQHandler"))) __attribute__((used));
@@ -710,55 +827,94 @@ void InterruptVector()         __attribute__((naked)) __attribute((section(".ini
 void InterruptVectorDefault()  __attribute__((naked)) __attribute((section(".init")));
 
 
+// Entries past VECTOR_TABLE_LAST are left out, and .text starts right after the
+// last one.  With -DTINYVECTOR, that's HardFault unless TINYVECTOR_LAST_IRQ says
+// otherwise, and the drivers in here that own an interrupt raise it to theirs.
+#ifdef TINYVECTOR
+#ifndef TINYVECTOR_LAST_IRQ
+#define TINYVECTOR_LAST_IRQ 3
+#endif
+#if defined( UART_DMA_RX ) && TINYVECTOR_LAST_IRQ < 32
+#define VECTOR_TABLE_LAST 32
+#elif defined( STDOUT_UART ) && defined( UART_DMA_TX ) && TINYVECTOR_LAST_IRQ < 25
+#define VECTOR_TABLE_LAST 25
+#else
+#define VECTOR_TABLE_LAST TINYVECTOR_LAST_IRQ
+#endif
+#else
+#define VECTOR_TABLE_LAST 38
+#endif
+#define VECTOR_STR2( x ) #x
+#define VECTOR_STR( x ) VECTOR_STR2( x )
+
 void InterruptVectorDefault()
 {
 	asm volatile( "\n\
 	.align  2\n\
 	.option   norvc;\n\
+	.equ vector_table_last, " VECTOR_STR( VECTOR_TABLE_LAST ) "\n\
+	.macro vector idx, handler\n\
+	.if \\idx <= vector_table_last\n\
+	.word \\handler\n\
+	.endif\n\
+	.endm\n\
 	j handle_reset\n\
-	.word   0\n\
-	.word   NMI_Handler               /* NMI Handler */                    \n\
-	.word   HardFault_Handler         /* Hard Fault Handler */             \n\
-	.word   0\n\
-	.word   0\n\
-	.word   0\n\
-	.word   0\n\
-	.word   0\n\
-	.word   0\n\
-	.word   0\n\
-	.word   0\n\
-	.word   SysTick_Handler           /* SysTick Handler */                \n\
-	.word   0\n\
-	.word   SW_Handler                /* SW Handler */                     \n\
-	.word   0\n\
+	vector 1, 0\n\
+	vector 2, NMI_Handler                /* NMI Handler */ \n\
+	vector 3, HardFault_Handler          /* Hard Fault Handler */ \n\
+	vector 4, 0\n\
+	vector 5, 0\n\
+	vector 6, 0\n\
+	vector 7, 0\n\
+	vector 8, 0\n\
+	vector 9, 0\n\
+	vector 10, 0\n\
+	vector 11, 0\n\
+	vector 12, SysTick_Handler           /* SysTick Handler */ \n\
+	vector 13, 0\n\
+	vector 14, SW_Handler                /* SW Handler */ \n\
+	vector 15, 0\n\
 	/* External Interrupts */                                              \n\
-	.word   WWDG_IRQHandler           /* Window Watchdog */                \n\
-	.word   PVD_IRQHandler            /* PVD through EXTI Line detect */   \n\
-	.word   FLASH_IRQHandler          /* Flash */                          \n\
-	.word   RCC_IRQHandler            /* RCC */                            \n\
-	.word   EXTI7_0_IRQHandler        /* EXTI Line 7..0 */                 \n\
-	.word   AWU_IRQHandler            /* AWU */                            \n\
-	.word   DMA1_Channel1_IRQHandler  /* DMA1 Channel 1 */                 \n\
-	.word   DMA1_Channel2_IRQHandler  /* DMA1 Channel 2 */                 \n\
-	.word   DMA1_Channel3_IRQHandler  /* DMA1 Channel 3 */                 \n\
-	.word   DMA1_Channel4_IRQHandler  /* DMA1 Channel 4 */                 \n\
-	.word   DMA1_Channel5_IRQHandler  /* DMA1 Channel 5 */                 \n\
-	.word   DMA1_Channel6_IRQHandler  /* DMA1 Channel 6 */                 \n\
-	.word   DMA1_Channel7_IRQHandler  /* DMA1 Channel 7 */                 \n\
-	.word   ADC1_IRQHandler           /* ADC1 */                           \n\
-	.word   I2C1_EV_IRQHandler        /* I2C1 Event */                     \n\
-	.word   I2C1_ER_IRQHandler        /* I2C1 Error */                     \n\
-	.word   USART1_IRQHandler         /* USART1 */                         \n\
-	.word   SPI1_IRQHandler           /* SPI1 */                           \n\
-	.word   TIM1_BRK_IRQHandler       /* TIM1 Break */                     \n\
-	.word   TIM1_UP_IRQHandler        /* TIM1 Update */                    \n\
-	.word   TIM1_TRG_COM_IRQHandler   /* TIM1 Trigger and Commutation */   \n\
-	.word   TIM1_CC_IRQHandler        /* TIM1 Capture Compare */           \n\
-	.word   TIM2_IRQHandler           /* TIM2 */                           \n");
+	vector 16, WWDG_IRQHandler           /* Window Watchdog */ \n\
+	vector 17, PVD_IRQHandler            /* PVD through EXTI Line detect */ \n\
+	vector 18, FLASH_IRQHandler          /* Flash */ \n\
+	vector 19, RCC_IRQHandler            /* RCC */ \n\
+	vector 20, EXTI7_0_IRQHandler        /* EXTI Line 7..0 */ \n\
+	vector 21, AWU_IRQHandler            /* AWU */ \n\
+	vector 22, DMA1_Channel1_IRQHandler  /* DMA1 Channel 1 */ \n\
+	vector 23, DMA1_Channel2_IRQHandler  /* DMA1 Channel 2 */ \n\
+	vector 24, DMA1_Channel3_IRQHandler  /* DMA1 Channel 3 */ \n\
+	vector 25, DMA1_Channel4_IRQHandler  /* DMA1 Channel 4 */ \n\
+	vector 26, DMA1_Channel5_IRQHandler  /* DMA1 Channel 5 */ \n\
+	vector 27, DMA1_Channel6_IRQHandler  /* DMA1 Channel 6 */ \n\
+	vector 28, DMA1_Channel7_IRQHandler  /* DMA1 Channel 7 */ \n\
+	vector 29, ADC1_IRQHandler           /* ADC1 */ \n\
+	vector 30, I2C1_EV_IRQHandler        /* I2C1 Event */ \n\
+	vector 31, I2C1_ER_IRQHandler        /* I2C1 Error */ \n\
+	vector 32, USART1_IRQHandler         /* USART1 */ \n\
+	vector 33, SPI1_IRQHandler           /* SPI1 */ \n\
+	vector 34, TIM1_BRK_IRQHandler       /* TIM1 Break */ \n\
+	vector 35, TIM1_UP_IRQHandler        /* TIM1 Update */ \n\
+	vector 36, TIM1_TRG_COM_IRQHandler   /* TIM1 Trigger and Commutation */ \n\
+	vector 37, TIM1_CC_IRQHandler        /* TIM1 Capture Compare */ \n\
+	vector 38, TIM2_IRQHandler           /* TIM2 */ \n");
 }
 
+#ifdef MEASURE_BOOT_TIME
+uint32_t boot_time_ticks;
+#endif
+
 void handle_reset()
 {
+#ifdef MEASURE_BOOT_TIME
+	// Start SysTick at HCLK from the very first instruction.  Nothing is set
+	// up yet, so like the rest of startup, this is done by hand.
+	asm volatile( "\n\
+	li a0, 0xe000f000\n\
+	sw zero, 8(a0)\n\
+	li a1, 5\n\
+	sw a1, 0(a0)\n" );
+#endif
 	asm volatile( "\n\
 .option push\n\
 .option norelax\n\
@@ -766,7 +922,9 @@ void handle_reset()
 .option pop\n\
 	la sp, _eusrstack\n\
 .option arch, +zicsr\n"
-	// Setup the interrupt vector, processor status and INTSYSCR.
+	// Setup the interrupt vector, processor status and INTSYSCR.  INTSYSCR (0x804) = 3
+	// turns on the hardware prologue/epilogue and interrupt nesting.  The low bits of
+	// mtvec = 3 make the vector table one of absolute handler addresses.
 "	li a0, 0x80\n\
 	csrw mstatus, a0\n\
 	li a3, 0x3\n\
@@ -776,27 +934,57 @@ void handle_reset()
 	csrw mtvec, a0\n" );
 
 	// Careful: Use registers to prevent overwriting of self-data.
-	// This clears out BSS.
+	// This clears out BSS, 16 bytes at a time, then any last words.
 asm volatile(
 "	la a0, _sbss\n\
 	la a1, _ebss\n\
-	li a2, 0\n\
-	bge a0, a1, 2f\n\
-1:	sw a2, 0(a0)\n\
+	addi a2, a1, -12\n\
+	bgeu a0, a2, 2f\n\
+1:	sw zero, 0(a0)\n\
+	sw zero, 4(a0)\n\
+	sw zero, 8(a0)\n\
+	sw zero, 12(a0)\n\
+	addi a0, a0, 16\n\
+	bltu a0, a2, 1b\n\
+2:	bgeu a0, a1, 3f\n\
+	sw zero, 0(a0)\n\
 	addi a0, a0, 4\n\
-	blt a0, a1, 1b\n\
-2:"
-	// This loads DATA from FLASH to RAM.
+	j 2b\n\
+3:"
+	// This loads DATA from FLASH to RAM, the same way.
 "	la a0, _data_lma\n\
 	la a1, _data_vma\n\
 	la a2, _edata\n\
-1:	beq a1, a2, 2f\n\
+	addi t1, a2, -12\n\
+	bgeu a1, t1, 2f\n\
+1:	lw a3, 0(a0)\n\
+	lw a4, 4(a0)\n\
+	lw a5, 8(a0)\n\
+	lw t0, 12(a0)\n\
+	sw a3, 0(a1)\n\
+	sw a4, 4(a1)\n\
+	sw a5, 8(a1)\n\
+	sw t0, 12(a1)\n\
+	addi a0, a0, 16\n\
+	addi a1, a1, 16\n\
+	bltu a1, t1, 1b\n\
+2:	bgeu a1, a2, 3f\n\
 	lw a3, 0(a0)\n\
 	sw a3, 0(a1)\n\
 	addi a0, a0, 4\n\
 	addi a1, a1, 4\n\
-	bne a1, a2, 1b\n\
-2:\n" );
+	j 2b\n\
+3:\n" );
+
+#ifdef MEASURE_BOOT_TIME
+	// Now that .bss is clear, it's safe to store to it.
+asm volatile(
+"	li a0, 0xe000f000\n\
+	lw a1, 8(a0)\n\
+	sw zero, 0(a0)\n\
+	la a0, boot_time_ticks\n\
+	sw a1, 0(a0)\n" );
+#endif
 
 	// set mepc to be main as the root app.
 asm volatile(
@@ -804,6 +992,27 @@ asm volatile(
 "	mret\n" : : [main]"r"(main) );
 }
 
+int RegisterFastIRQ( IRQn_Type irq, void (*handler)( void ) )
+{
+	int i;
+	for( i = 0; i < 2; i++ )
+		if( ( NVIC->VTFADDR[i] & 1 ) && NVIC->VTFIDR[i] == irq ) break;
+	if( i == 2 )
+		for( i = 0; i < 2; i++ )
+			if( !( NVIC->VTFADDR[i] & 1 ) ) break;
+	if( i == 2 ) return -1;
+	SetVTFIRQ( (uint32_t)handler, irq, i, ENABLE );
+	return i;
+}
+
+void UnregisterFastIRQ( IRQn_Type irq )
+{
+	int i;
+	for( i = 0; i < 2; i++ )
+		if( ( NVIC->VTFADDR[i] & 1 ) && NVIC->VTFIDR[i] == irq )
+			NVIC->VTFADDR[i] = 0;
+}
+
 void SystemInit48HSI( void )
 {
 	// Values lifted from the EVT.  There is little to no documentation on what this does.
@@ -864,11 +1073,254 @@ void SetupUART( int uartBRR )
 	USART1->CTLR2 = USART_StopBits_1;
 	USART1->CTLR3 = USART_HardwareFlowControl_None;
 
+#ifdef UART_DMA_RX
+	// Input with pull-up, GPIO D6
+	GPIOD->CFGLR &= ~(0xf<<(4*6));
+	GPIOD->CFGLR |= GPIO_CNF_IN_PUPD<<(4*6);
+	GPIOD->BSHR = 1<<6;
+
+	// DMA1 channel 5 is USART1_RX.  It runs forever, around the ring; the half and
+	// complete interrupts only make sure the write count is caught up once per half.
+	RCC->AHBPCENR |= RCC_AHBPeriph_DMA1;
+	DMA1_Channel5->CFGR = 0;
+	DMA1_Channel5->PADDR = (uint32_t)&USART1->DATAR;
+	DMA1_Channel5->MADDR = (uint32_t)uart_rx_buffer.data;
+	DMA1_Channel5->CNTR = UART_RX_BUFFER_SIZE;
+	DMA1->INTFCR = DMA1_IT_GL5;
+	DMA1_Channel5->CFGR = DMA_DIR_PeripheralSRC | DMA_MemoryInc_Enable | DMA_Mode_Circular |
+		DMA_Priority_High | DMA_CFGR1_TCIE | DMA_CFGR1_HTIE | DMA_CFGR1_EN;
+
+	USART1->CTLR1 |= USART_Mode_Rx | USART_CTLR1_IDLEIE;
+	USART1->CTLR3 |= USART_DMAReq_Rx;
+	NVIC_EnableIRQ( DMA1_Channel5_IRQn );
+	NVIC_EnableIRQ( USART1_IRQn );
+#endif
+
 	USART1->BRR = uartBRR;
 	USART1->CTLR1 |= CTLR1_UE_Set;
+
+#if defined( STDOUT_UART ) && defined( UART_DMA_TX )
+	// DMA1 channel 4 is USART1_TX.  It's started per-chunk by UARTTxService.
+	RCC->AHBPCENR |= RCC_AHBPeriph_DMA1;
+	DMA1_Channel4->CFGR = 0;
+	DMA1_Channel4->PADDR = (uint32_t)&USART1->DATAR;
+	DMA1->INTFCR = DMA1_IT_GL4;
+	USART1->CTLR3 |= USART_DMAReq_Tx;
+	NVIC_EnableIRQ( DMA1_Channel4_IRQn );
+#endif
+}
+
+#ifdef UART_DMA_RX
+struct UARTRxBuffer uart_rx_buffer;
+
+// Moves head up to where the DMA is.  Since this runs at least every half buffer,
+// the distance from the last position is always less than a lap.  Interrupts must be off.
+static void UARTRxService()
+{
+	struct UARTRxBuffer * u = &uart_rx_buffer;
+	uint32_t pos = UART_RX_BUFFER_SIZE - DMA1_Channel5->CNTR;
+	u->head += ( pos - u->head ) & ( UART_RX_BUFFER_SIZE - 1 );
+}
+
+void DMA1_Channel5_IRQHandler( void )
+{
+	DMA1->INTFCR = DMA1_IT_GL5;
+	UARTRxService();
+}
+
+void USART1_IRQHandler( void )
+{
+	struct UARTRxBuffer * u = &uart_rx_buffer;
+
+	// Reading STATR then DATAR clears IDLE and ORE.  Only IDLEIE is on, but if
+	// IDLE isn't set, DATAR may hold a byte the DMA hasn't taken yet, so leave it.
+	// With IDLE set the line has been quiet for a frame, and the DMA has it all.
+	uint32_t statr = USART1->STATR;
+	if( !( statr & USART_FLAG_IDLE ) ) return;
+	(void)USART1->DATAR;
+	if( statr & USART_FLAG_ORE ) u->hw_overrun++;
+
+	UARTRxService();
+	uint32_t mh = u->message_head;
+	uint32_t head = u->head;
+	if( mh != u->message_tail && u->message_end[(mh-1) & ( UART_RX_MESSAGES - 1 )] == head )
+		return;
+	if( mh - u->message_tail == UART_RX_MESSAGES )
+	{
+		// No room; the newest waiting message grows to include this one.
+		u->message_end[(mh-1) & ( UART_RX_MESSAGES - 1 )] = head;
+		return;
+	}
+	u->message_end[mh & ( UART_RX_MESSAGES - 1 )] = head;
+	u->message_head = mh + 1;
+}
+
+// Catches head up, and if the DMA has lapped the reader, skips the reader ahead.
+static uint32_t UARTRxPoll()
+{
+	struct UARTRxBuffer * u = &uart_rx_buffer;
+	uint32_t mstatus;
+	__asm volatile( "csrrci %0, mstatus, 0x8" : "=r"(mstatus) : : "memory" );
+	UARTRxService();
+	uint32_t head = u->head;
+	__asm volatile( "csrw mstatus, %0" : : "r"(mstatus) : "memory" );
+	if( head - u->tail > UART_RX_BUFFER_SIZE )
+	{
+		u->overrun += head - u->tail - UART_RX_BUFFER_SIZE;
+		u->tail = head - UART_RX_BUFFER_SIZE;
+	}
+	return head;
+}
+
+static int UARTRxCopy( uint8_t * buf, uint32_t len )
+{
+	struct UARTRxBuffer * u = &uart_rx_buffer;
+	uint32_t start = u->tail & ( UART_RX_BUFFER_SIZE - 1 );
+	uint32_t first = UART_RX_BUFFER_SIZE - start;
+	if( first > len ) first = len;
+	memcpy( buf, u->data + start, first );
+	memcpy( buf + first, u->data, len - first );
+	u->tail += len;
+	return len;
+}
+
+int UARTRxAvailable()
+{
+	return UARTRxPoll() - uart_rx_buffer.tail;
+}
+
+int UARTRead( uint8_t * buf, int max )
+{
+	uint32_t len = UARTRxPoll() - uart_rx_buffer.tail;
+	if( !len ) return -1;
+	if( len > (uint32_t)max ) len = max;
+	return UARTRxCopy( buf, len );
+}
+
+int UARTReadMessage( uint8_t * buf, int max )
+{
+	struct UARTRxBuffer * u = &uart_rx_buffer;
+	UARTRxPoll();
+	while( u->message_tail != u->message_head )
+	{
+		uint32_t end = u->message_end[u->message_tail & ( UART_RX_MESSAGES - 1 )];
+		u->message_tail++;
+
+		// A message that's already been read past, by UARTRead or an overrun.
+		if( (int32_t)( end - u->tail ) <= 0 ) continue;
+
+		uint32_t len = end - u->tail;
+		if( len > (uint32_t)max ) len = max;
+		UARTRxCopy( buf, len );
+		u->tail = end;
+		return len;
+	}
+	return -1;
+}
+#endif
+
+#if defined( STDOUT_UART ) && defined( UART_DMA_TX )
+struct UARTTxBuffer uart_tx_buffer;
+
+// Frees what the DMA has already sent, and if it has finished its chunk, hands it
+// the next contiguous run of the ring.  The half transfer interrupt just gives
+// writers their room back sooner.  Must be called with interrupts off.
+static void UARTTxService()
+{
+	struct UARTTxBuffer * u = &uart_tx_buffer;
+	uint32_t next = u->next;
+
+	DMA1->INTFCR = DMA1_IT_GL4;
+	if( DMA1_Channel4->CFGR & DMA_CFGR1_EN )
+	{
+		uint32_t remain = DMA1_Channel4->CNTR;
+		u->tail = next - remain;
+		if( remain ) return;
+		DMA1_Channel4->CFGR = 0;
+	}
+
+	uint32_t len = u->head - next;
+	if( !len ) return;
+	uint32_t start = next & ( UART_TX_BUFFER_SIZE - 1 );
+	if( len > UART_TX_BUFFER_SIZE - start ) len = UART_TX_BUFFER_SIZE - start;
+
+	DMA1_Channel4->MADDR = (uint32_t)&u->data[start];
+	DMA1_Channel4->CNTR = len;
+	u->next = next + len;
+	DMA1_Channel4->CFGR = DMA_DIR_PeripheralDST | DMA_MemoryInc_Enable | DMA_Priority_Low |
+		DMA_CFGR1_TCIE | DMA_CFGR1_HTIE | DMA_CFGR1_EN;
 }
 
-#ifdef STDOUT_UART
+static void UARTTxKick()
+{
+	uint32_t mstatus;
+	__asm volatile( "csrrci %0, mstatus, 0x8" : "=r"(mstatus) : : "memory" );
+	UARTTxService();
+	__asm volatile( "csrw mstatus, %0" : : "r"(mstatus) : "memory" );
+}
+
+void DMA1_Channel4_IRQHandler( void )
+{
+	UARTTxService();
+}
+
+// Copies into the ring and returns.  Not for use from both interrupts and main
+// code at once; the ring has a single writer.
+int _write(int fd, const char *buf, int size)
+{
+	struct UARTTxBuffer * u = &uart_tx_buffer;
+	int place = 0;
+	while( place < size )
+	{
+		uint32_t head = u->head;
+		uint32_t room = UART_TX_BUFFER_SIZE - ( head - u->tail );
+		if( room == 0 )
+		{
+#if UART_TX_FULL_POLICY == UART_TX_FULL_DROP
+			u->dropped += size - place;
+			break;
+#else
+#if UART_TX_FULL_POLICY == UART_TX_FULL_OVERWRITE
+			uint32_t mstatus;
+			__asm volatile( "csrrci %0, mstatus, 0x8" : "=r"(mstatus) : : "memory" );
+			u->dropped += u->head - u->next;
+			u->head = u->next;
+			__asm volatile( "csrw mstatus, %0" : : "r"(mstatus) : "memory" );
+#endif
+			// If everything is already on the wire, or the policy is to block, wait
+			// on the DMA.  Polling it here means this works with interrupts off, too.
+			UARTTxKick();
+			continue;
+#endif
+		}
+
+		uint32_t start = head & ( UART_TX_BUFFER_SIZE - 1 );
+		uint32_t n = size - place;
+		if( n > room ) n = room;
+		if( n > UART_TX_BUFFER_SIZE - start ) n = UART_TX_BUFFER_SIZE - start;
+		memcpy( &u->data[start], buf + place, n );
+		__asm volatile( "" : : : "memory" );
+		u->head = head + n;
+		place += n;
+		UARTTxKick();
+	}
+	return size;
+}
+
+int putchar(int c)
+{
+	char ch = c;
+	_write( 0, &ch, 1 );
+	return 1;
+}
+
+void UARTFlush()
+{
+	while( uart_tx_buffer.tail != uart_tx_buffer.head )
+		UARTTxKick();
+	while( !(USART1->STATR & USART_FLAG_TC) );
+}
+#elif defined( STDOUT_UART )
 // For debug writing to the UART.
 int _write(int fd, const char *buf, int size)
 {
@@ -891,6 +1343,59 @@ int putchar(int c)
 #define DMDATA0 ((volatile uint32_t*)0xe00000f4)
 #define DMDATA1 ((volatile uint32_t*)0xe00000f8)
 
+#ifdef BUFFERED_DEBUG_PRINTF
+struct DebugPrintfBuffer debug_printf_buffer;
+
+int DebugPrintfFree()
+{
+	return DEBUG_PRINTF_BUFFER_SIZE - ( debug_printf_buffer.head - debug_printf_buffer.tail );
+}
+
+// Hands the host the next 7 bytes, if it's taken the last ones.  Never waits.
+void DebugPrintfPump()
+{
+	struct DebugPrintfBuffer * b = &debug_printf_buffer;
+	uint32_t mstatus;
+	__asm volatile( "csrrci %0, mstatus, 0x8" : "=r"(mstatus) : : "memory" );
+	uint32_t tail = b->tail;
+	uint32_t len = b->head - tail;
+	if( len && !( *DMDATA0 & 0x80 ) )
+	{
+		char buffer[8] = { 0 };
+		if( len > 7 ) len = 7;
+		for( int i = 0; i < len; i++ )
+			buffer[i+1] = b->data[(tail+i) & ( DEBUG_PRINTF_BUFFER_SIZE - 1 )];
+		buffer[0] = 0x80 | ( len + 4 );
+		*DMDATA1 = *(uint32_t*)&(buffer[4]);
+		*DMDATA0 = *(uint32_t*)&(buffer[0]);
+		b->tail = tail + len;
+	}
+	__asm volatile( "csrw mstatus, %0" : : "r"(mstatus) : "memory" );
+}
+
+// Copies into the ring, dropping what doesn't fit, and gives the pump a nudge.
+int _write(int fd, const char *buf, int size)
+{
+	struct DebugPrintfBuffer * b = &debug_printf_buffer;
+	uint32_t head = b->head;
+	uint32_t n = DebugPrintfFree();
+	if( n > size ) n = size;
+	for( int i = 0; i < n; i++ )
+		b->data[(head+i) & ( DEBUG_PRINTF_BUFFER_SIZE - 1 )] = buf[i];
+	__asm volatile( "" : : : "memory" );
+	b->head = head + n;
+	b->dropped += size - n;
+	DebugPrintfPump();
+	return size;
+}
+
+int putchar(int c)
+{
+	char ch = c;
+	_write( 0, &ch, 1 );
+	return 1;
+}
+#else
 int _write(int fd, const char *buf, int size)
 {
 	char buffer[4] = { 0 };
@@ -935,6 +1440,7 @@ int putchar(int c)
 	*DMDATA0 = 0x85 | ((const char)c<<8);
 	return 1;
 }
+#endif
 
 void SetupDebugPrintf()
 {
@@ -950,6 +1456,47 @@ void WaitForDebuggerToAttach()
 
 #endif
 
+// The three-instruction sequence is what minichlink looks for around the
+// ebreak; it must not be compressed, and is word aligned so it can be read back.
+static int SemihostCall( int op, const void * args )
+{
+	register int a0 asm("a0") = op;
+	register const void * a1 asm("a1") = args;
+	asm volatile(
+		".option push\n"
+		".option norvc\n"
+		".balign 4\n"
+		"slli x0, x0, 0x1f\n"
+		"ebreak\n"
+		"srai x0, x0, 7\n"
+		".option pop\n"
+		: "+r"(a0) : "r"(a1) : "memory" );
+	return a0;
+}
+
+int SemihostOpen( const char * name, int mode )
+{
+	uintptr_t args[3] = { (uintptr_t)name, mode, strlen( name ) };
+	return SemihostCall( 0x01, args );
+}
+
+int SemihostClose( int fd )
+{
+	return SemihostCall( 0x02, &fd );
+}
+
+int SemihostWrite( int fd, const void * buf, int len )
+{
+	uintptr_t args[3] = { fd, (uintptr_t)buf, len };
+	return SemihostCall( 0x05, args );
+}
+
+int SemihostRead( int fd, void * buf, int len )
+{
+	uintptr_t args[3] = { fd, (uintptr_t)buf, len };
+	return SemihostCall( 0x06, args );
+}
+
 void DelaySysTick( uint32_t n )
 {
     SysTick->SR &= ~(1 << 0);
@@ -960,3 +1507,58 @@ void DelaySysTick( uint32_t n )
     SysTick->CTLR &= ~(1 << 0);
 }
 
+#ifdef ENABLE_TRACE
+// minichlink finds this by name in the ELF, so don't rename it.
+struct TraceBuffer trace_buffer __attribute__((used));
+
+void SetupTrace( uint32_t core_clock_hz )
+{
+	trace_buffer.head = 0;
+	trace_buffer.entries = TRACE_BUFFER_ENTRIES;
+
+	// Free-running, HCLK/1, no reload.  If SysTick is already running (i.e. for an
+	// IRQ) leave it alone, but the host will see the timestamps wrap at CMP.
+	if( !( SysTick->CTLR & 1 ) )
+	{
+		SysTick->CNT = 0;
+		SysTick->CTLR = (1<<2) | (1<<0);
+	}
+
+	// STCLK (bit 2) clear means SysTick runs at HCLK/8.
+	trace_buffer.ticks_per_us = core_clock_hz / ( ( SysTick->CTLR & (1<<2) ) ? 1000000 : 8000000 );
+}
+#endif
+
+#ifdef ENABLE_DLOG
+struct DLogBuffer dlog_buffer;
+
+void DLogPump()
+{
+	while( dlog_buffer.tail != dlog_buffer.head )
+	{
+#if defined( BUFFERED_DEBUG_PRINTF ) && !defined( STDOUT_UART )
+		if( DebugPrintfFree() < 7 ) return;
+#elif !defined( STDOUT_UART )
+		// Don't wait on the host; just come back next time.
+		if( *DMDATA0 & 0x80 ) return;
+#endif
+		char frame[7];
+		int n = 0;
+		uint32_t tail = dlog_buffer.tail;
+		uint32_t tail_byte = dlog_buffer.tail_byte;
+		while( n < 7 && tail != dlog_buffer.head )
+		{
+			frame[n++] = dlog_buffer.words[tail & (DLOG_BUFFER_WORDS-1)] >> ( tail_byte * 8 );
+			if( ++tail_byte == 4 )
+			{
+				tail_byte = 0;
+				tail++;
+			}
+		}
+		_write( 0, frame, n );
+		dlog_buffer.tail_byte = tail_byte;
+		dlog_buffer.tail = tail;
+	}
+}
+#endif
+
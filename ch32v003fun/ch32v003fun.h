@@ -4827,6 +4827,31 @@ void DefaultIRQHandler( void ) __attribute__((section(".text.vector_handler")))
 
 void DelaySysTick( uint32_t n );
 
+// Startup turns on the QingKe hardware prologue/epilogue (HPE, bit 0 of INTSYSCR, CSR
+// 0x804), so on interrupt entry the core itself saves ra, t0-t2 and a0-a5, everything a
+// C function may clobber, and restores them on mret.  A plain __attribute__((interrupt))
+// handler saves them all again.  INTERRUPT_FAST( SPI1_IRQHandler ) { ... } defines a
+// handler that skips that: a naked stub calls the body as an ordinary function.  It only
+// works with HPE on, and with no more than two levels of nesting (bit 1, INESTEN), as
+// that's how deep the hardware stack goes.
+#define INTERRUPT_FAST( name ) \
+	void name##_body( void ) __attribute__((used)); \
+	void name( void ) __attribute__((naked)); \
+	void name( void ) { asm volatile( "call " #name "_body\n\tmret" ); } \
+	void name##_body( void )
+
+// Vector table free (VTF) interrupts.  Up to two IRQs can jump straight to their handler,
+// without the core fetching its address from the vector table first.  Returns the slot
+// used, or -1 if both are taken.  Handlers should be INTERRUPT_FAST.
+int RegisterFastIRQ( IRQn_Type irq, void (*handler)( void ) );
+void UnregisterFastIRQ( IRQn_Type irq );
+
+// -DTINYVECTOR cuts the vector table short to save flash: by default it stops after
+// HardFault, 16 bytes instead of 156.  To use interrupts, pass the highest one you use
+// as a number, e.g. -DTINYVECTOR_LAST_IRQ=12 for SysTick (see IRQn_Type); the table is
+// cut after it.  An interrupt past the end of the table would jump into code, but a VTF
+// interrupt never looks at the table, so it doesn't need an entry.
+
 #define Delay_Us(n) DelaySysTick( n * DELAY_US_TIME )
 #define Delay_Ms(n) DelaySysTick( n * DELAY_MS_TIME )
 
@@ -4857,6 +4882,266 @@ void WaitForDebuggerToAttach();
 // Just a definition to the internal _write function.
 int _write(int fd, const char *buf, int size);
 
+// Variables marked NOINIT go in .noinit, which startup neither clears nor loads, so they
+// keep their values across a reset (but not a power cycle).  Check them for sanity first.
+#define NOINIT __attribute__((section(".noinit")))
+
+// Build with -DMEASURE_BOOT_TIME and boot_time_ticks holds how many HCLK ticks (8 MHz out
+// of reset) it took from the reset vector to main.  SysTick is stopped again before main.
+#ifdef MEASURE_BOOT_TIME
+extern uint32_t boot_time_ticks;
+#endif
+
+// Buffered debug printf.  Build with -DBUFFERED_DEBUG_PRINTF and printf over the debug
+// interface only copies into a RAM ring instead of waiting on the host.  Each call to
+// DebugPrintfPump() hands the host the next 7 bytes if it has taken the last ones, and
+// returns right away if it hasn't; call it from the main loop or a low priority timer
+// interrupt.  printf gives it a nudge too.  What doesn't fit in the ring is dropped and
+// counted in debug_printf_buffer.dropped, so nothing waits, debugger or not.
+#if defined( BUFFERED_DEBUG_PRINTF ) && !defined( STDOUT_UART )
+
+#ifndef DEBUG_PRINTF_BUFFER_SIZE
+#define DEBUG_PRINTF_BUFFER_SIZE 128 // Must be a power of 2.
+#endif
+
+struct DebugPrintfBuffer
+{
+	volatile uint32_t head; // Only moved by _write.
+	volatile uint32_t tail; // Only moved by DebugPrintfPump.
+	uint32_t dropped;
+	char data[DEBUG_PRINTF_BUFFER_SIZE];
+};
+
+extern struct DebugPrintfBuffer debug_printf_buffer;
+
+void DebugPrintfPump();
+int DebugPrintfFree();
+
+#endif
+
+// Buffered UART output.  Build with -DSTDOUT_UART -DUART_DMA_TX and printf only copies
+// into a RAM ring; DMA1 channel 4 feeds it to USART1 in the background, so the channel
+// and its interrupt belong to stdout.  When the ring is full, UART_TX_FULL_POLICY says
+// what happens: BLOCK waits for room, DROP throws the new text away and OVERWRITE
+// throws away what's waiting to go out (not what's already on the wire) so the newest
+// text gets through.  Dropped bytes are counted in uart_tx_buffer.dropped.  Call
+// UARTFlush() before sleeping or resetting if the tail end of the output matters.
+#if defined( STDOUT_UART ) && defined( UART_DMA_TX )
+
+#ifndef UART_TX_BUFFER_SIZE
+#define UART_TX_BUFFER_SIZE 128 // Must be a power of 2.
+#endif
+
+#define UART_TX_FULL_BLOCK     0
+#define UART_TX_FULL_DROP      1
+#define UART_TX_FULL_OVERWRITE 2
+
+#ifndef UART_TX_FULL_POLICY
+#define UART_TX_FULL_POLICY UART_TX_FULL_BLOCK
+#endif
+
+struct UARTTxBuffer
+{
+	volatile uint32_t head; // Only moved by _write.
+	volatile uint32_t tail; // Oldest byte the DMA hasn't sent yet.
+	volatile uint32_t next; // End of what has been handed to the DMA.
+	uint32_t dropped;
+	uint8_t data[UART_TX_BUFFER_SIZE];
+};
+
+extern struct UARTTxBuffer uart_tx_buffer;
+
+void UARTFlush();
+
+#endif
+
+// Buffered UART input on Pin D6.  Build with -DUART_DMA_RX and SetupUART also turns on the
+// receiver; DMA1 channel 5 writes everything into a circular RAM buffer with no per-byte
+// interrupts, and the USART idle-line interrupt marks where each message ends.
+// UARTRead takes whatever has arrived, UARTReadMessage one complete message (a longer
+// message than fits in buf is cut short), and neither blocks.  Both return -1 if there's
+// nothing to read.  If the reader falls more than a buffer behind, the oldest bytes are
+// lost and counted in uart_rx_buffer.overrun; bytes the USART itself lost are counted
+// in hw_overrun.  DMA1 channel 5 and the USART1 interrupt belong to this driver.
+#ifdef UART_DMA_RX
+
+#ifndef UART_RX_BUFFER_SIZE
+#define UART_RX_BUFFER_SIZE 64 // Must be a power of 2.
+#endif
+
+#ifndef UART_RX_MESSAGES
+#define UART_RX_MESSAGES 4 // Message ends that can be waiting.  Must be a power of 2.
+#endif
+
+struct UARTRxBuffer
+{
+	volatile uint32_t head; // Total bytes the DMA has written.  Updated by UARTRxService.
+	uint32_t tail;          // Total bytes read.
+	volatile uint32_t message_head;
+	uint32_t message_tail;
+	volatile uint32_t message_end[UART_RX_MESSAGES];
+	uint32_t overrun;
+	volatile uint32_t hw_overrun;
+	uint8_t data[UART_RX_BUFFER_SIZE];
+};
+
+extern struct UARTRxBuffer uart_rx_buffer;
+
+int UARTRxAvailable();
+int UARTRead( uint8_t * buf, int max );
+int UARTReadMessage( uint8_t * buf, int max );
+
+#endif
+
+// Semihosting, for moving bulk binary data to and from files on the host.
+// Only usable while `minichlink --semihost` is attached: it sets dcsr.ebreakm
+// so the ebreak in each call halts the part; without it, the ebreak traps.
+// Open returns a handle, or -1.  Write and Read return the number of bytes NOT
+// transferred, so 0 is success.  Handles 1 and 2 are the host's stdout and stderr.
+#define SEMIHOST_MODE_RB 1
+#define SEMIHOST_MODE_WB 5
+#define SEMIHOST_MODE_AB 9
+int SemihostOpen( const char * name, int mode );
+int SemihostClose( int fd );
+int SemihostWrite( int fd, const void * buf, int len );
+int SemihostRead( int fd, void * buf, int len );
+
+// Binary event tracing.  Build with -DENABLE_TRACE, call SetupTrace( SYSTEM_CORE_CLOCK )
+// then sprinkle TRACE_EVENT( name, arg ) / TRACE_BEGIN / TRACE_END around.  Each event
+// is a SysTick timestamp, the event name and a 16-bit argument written into a RAM ring.
+// The name is an identifier, not a string; it is stored in the non-loaded .trace_names
+// section of the ELF, so it costs no flash.  Drain with `minichlink --trace app.elf out.json`.
+// SysTick is left free-running at HCLK; don't use DelaySysTick while tracing.
+#ifdef ENABLE_TRACE
+
+#ifndef TRACE_BUFFER_ENTRIES
+#define TRACE_BUFFER_ENTRIES 32 // Must be a power of 2.
+#endif
+
+struct TraceRecord
+{
+	uint32_t time;
+	uint32_t id_arg; // Bits 0..13 = name offset, 14..15 = phase, 16..31 = argument.
+};
+
+struct TraceBuffer
+{
+	volatile uint32_t head;
+	uint16_t entries;
+	uint16_t ticks_per_us;
+	struct TraceRecord records[TRACE_BUFFER_ENTRIES];
+};
+
+extern struct TraceBuffer trace_buffer;
+
+void SetupTrace( uint32_t core_clock_hz );
+
+static inline void TraceEmit( uint32_t id, uint32_t arg )
+{
+	uint32_t mstatus;
+	__asm volatile( "csrrci %0, mstatus, 0x8" : "=r"(mstatus) : : "memory" );
+	uint32_t head = trace_buffer.head;
+	struct TraceRecord * r = &trace_buffer.records[head & (TRACE_BUFFER_ENTRIES-1)];
+	r->time = SysTick->CNT;
+	r->id_arg = id | ( arg << 16 );
+	trace_buffer.head = head + 1;
+	__asm volatile( "csrw mstatus, %0" : : "r"(mstatus) : "memory" );
+}
+
+#define TRACE_EMIT( name, phase, arg ) do { \
+	static const char _trace_name[] __attribute__((section(".trace_names"),used)) = #name; \
+	TraceEmit( (uint32_t)(uintptr_t)_trace_name | ((phase)<<14), (uint16_t)(arg) ); } while( 0 )
+
+#else
+
+#define TRACE_EMIT( name, phase, arg ) do { } while( 0 )
+
+#endif
+
+#define TRACE_EVENT( name, arg ) TRACE_EMIT( name, 0, arg )
+#define TRACE_BEGIN( name, arg ) TRACE_EMIT( name, 1, arg )
+#define TRACE_END( name, arg )   TRACE_EMIT( name, 2, arg )
+
+// Deferred logging.  Build with -DENABLE_DLOG, then DLOG( "adc %d at %u\n", v, t ); with
+// up to 4 integer arguments.  The format string goes in the non-loaded .dlog_strings
+// section of the ELF, so it costs no flash, and the call only drops its offset and the
+// raw arguments into a RAM ring.  Call DLogPump() from the main loop to send what's
+// waiting over the same channel as printf, without blocking on the debug channel.
+// `minichlink --dlog app.elf` formats them on the host, or for a capture of the UART,
+// `minichlink --dlog-decode app.elf capture.bin`.  %s can't be shown; the string isn't
+// on the host.  If the ring is full, messages are dropped and counted in dlog_buffer.dropped.
+#ifdef ENABLE_DLOG
+
+#ifndef DLOG_BUFFER_WORDS
+#define DLOG_BUFFER_WORDS 32 // Must be a power of 2.
+#endif
+
+struct DLogBuffer
+{
+	volatile uint32_t head; // In words.  Only moved by DLogEmit.
+	volatile uint32_t tail; // In words.  Only moved by DLogPump.
+	uint32_t tail_byte;     // How much of the word at tail has gone out.
+	uint32_t dropped;
+	uint32_t words[DLOG_BUFFER_WORDS];
+};
+
+extern struct DLogBuffer dlog_buffer;
+
+void DLogPump();
+
+// Each message is a header word, 0x1e (the host syncs on it), the argument count
+// and the format's offset, followed by the arguments.
+static inline void DLogEmit( uint32_t id, const uint32_t * args, uint32_t nargs )
+{
+	uint32_t mstatus;
+	__asm volatile( "csrrci %0, mstatus, 0x8" : "=r"(mstatus) : : "memory" );
+	uint32_t head = dlog_buffer.head;
+	if( head - dlog_buffer.tail + nargs < DLOG_BUFFER_WORDS )
+	{
+		dlog_buffer.words[head++ & (DLOG_BUFFER_WORDS-1)] = 0x1e | ( nargs << 8 ) | ( id << 16 );
+		for( uint32_t i = 0; i < nargs; i++ )
+			dlog_buffer.words[head++ & (DLOG_BUFFER_WORDS-1)] = args[i];
+		dlog_buffer.head = head;
+	}
+	else
+		dlog_buffer.dropped++;
+	__asm volatile( "csrw mstatus, %0" : : "r"(mstatus) : "memory" );
+}
+
+// Each argument goes in as a word, through uintptr_t, so pointers log as their
+// address rather than tripping an int-conversion error.  5 to 8 arguments land on
+// DLOG_MAPX, which passes an extra word to set off the assert in DLOG.
+#define DLOG_ARG( x ) (uint32_t)(uintptr_t)( x )
+#define DLOG_NARGS( ... ) DLOG_NARGS_( 0, ##__VA_ARGS__, X, X, X, X, 4, 3, 2, 1, 0 )
+#define DLOG_NARGS_( _0, _1, _2, _3, _4, _5, _6, _7, _8, N, ... ) N
+#define DLOG_MAP( ... ) DLOG_MAP_( DLOG_NARGS( __VA_ARGS__ ), ##__VA_ARGS__ )
+#define DLOG_MAP_( n, ... ) DLOG_MAP__( n, ##__VA_ARGS__ )
+#define DLOG_MAP__( n, ... ) DLOG_MAP##n( __VA_ARGS__ )
+#define DLOG_MAP0()
+#define DLOG_MAP1( a ) , DLOG_ARG( a )
+#define DLOG_MAP2( a, b ) , DLOG_ARG( a ), DLOG_ARG( b )
+#define DLOG_MAP3( a, b, c ) , DLOG_ARG( a ), DLOG_ARG( b ), DLOG_ARG( c )
+#define DLOG_MAP4( a, b, c, d ) , DLOG_ARG( a ), DLOG_ARG( b ), DLOG_ARG( c ), DLOG_ARG( d )
+#define DLOG_MAPX( ... ) , 0, 0, 0, 0, 0
+
+#ifdef __cplusplus
+#define DLOG_STATIC_ASSERT static_assert
+#else
+#define DLOG_STATIC_ASSERT _Static_assert
+#endif
+
+#define DLOG( fmt, ... ) do { \
+	static const char _dlog_fmt[] __attribute__((section(".dlog_strings"),used)) = fmt; \
+	const uint32_t _dlog_args[] = { 0 DLOG_MAP( __VA_ARGS__ ) }; \
+	DLOG_STATIC_ASSERT( sizeof( _dlog_args ) <= 5 * sizeof( uint32_t ), "DLOG() takes at most 4 arguments" ); \
+	DLogEmit( (uint32_t)(uintptr_t)_dlog_fmt, _dlog_args + 1, sizeof( _dlog_args ) / sizeof( uint32_t ) - 1 ); } while( 0 )
+
+#else
+
+#define DLOG( fmt, ... ) do { } while( 0 )
+
+#endif
+
 #ifdef __cplusplus
 };
 #endif
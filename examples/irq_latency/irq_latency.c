@@ -0,0 +1,86 @@
+/* Measures how long it takes to get into an interrupt handler: an ordinary
+   __attribute__((interrupt)) handler through the vector table, then an
+   INTERRUPT_FAST handler registered as a VTF interrupt, for the same SysTick
+   compare.  Each handler reads SysTick first thing, so the difference from
+   the compare value is the entry latency in HCLK cycles.  Run `make monitor`. */
+
+#define SYSTEM_CORE_CLOCK 48000000
+
+#include "ch32v003fun.h"
+#include <stdio.h>
+
+#define SYSTICK_CTLR_STE   (1<<0)
+#define SYSTICK_CTLR_STIE  (1<<1)
+#define SYSTICK_CTLR_STCLK (1<<2)
+
+volatile uint32_t latency;
+volatile int fired;
+
+static void TickDone( uint32_t now )
+{
+	latency = now - SysTick->CMP;
+	SysTick->CTLR &= ~SYSTICK_CTLR_STIE;
+	SysTick->SR = 0;
+	fired = 1;
+}
+
+void SysTick_Handler( void ) __attribute__((interrupt));
+void SysTick_Handler( void )
+{
+	TickDone( SysTick->CNT );
+}
+
+INTERRUPT_FAST( FastTick_Handler )
+{
+	TickDone( SysTick->CNT );
+}
+
+static uint32_t MeasureOnce()
+{
+	fired = 0;
+	SysTick->SR = 0;
+	SysTick->CMP = SysTick->CNT + 1000;
+	SysTick->CTLR |= SYSTICK_CTLR_STIE;
+	while( !fired );
+	return latency;
+}
+
+static uint32_t Measure()
+{
+	// Keep the best of a few, in case something else got in the way.
+	uint32_t best = ~0;
+	int i;
+	for( i = 0; i < 16; i++ )
+	{
+		uint32_t l = MeasureOnce();
+		if( l < best ) best = l;
+	}
+	return best;
+}
+
+int main()
+{
+	SystemInit48HSI();
+	SetupDebugPrintf();
+
+	NVIC_EnableIRQ( SysTicK_IRQn );
+
+	while(1)
+	{
+		// Free running at HCLK, with no reload.
+		SysTick->CNT = 0;
+		SysTick->CTLR = SYSTICK_CTLR_STE | SYSTICK_CTLR_STCLK;
+
+		uint32_t normal = Measure();
+
+		RegisterFastIRQ( SysTicK_IRQn, FastTick_Handler );
+		uint32_t fast = Measure();
+		UnregisterFastIRQ( SysTicK_IRQn );
+
+		// Delay_Ms expects SysTick stopped, at HCLK/8.
+		SysTick->CTLR = 0;
+
+		printf( "Entry latency: vector table %lu cycles, VTF + INTERRUPT_FAST %lu cycles\n", normal, fast );
+		Delay_Ms( 1000 );
+	}
+}
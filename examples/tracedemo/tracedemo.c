@@ -0,0 +1,49 @@
+/* Small example showing how to use TRACE_EVENT() to time code on a running
+   part.  Run `make trace`, then load tracedemo.json in chrome://tracing or
+   https://ui.perfetto.dev */
+
+#define SYSTEM_CORE_CLOCK 48000000
+
+#include "ch32v003fun.h"
+#include <stdio.h>
+
+static void DoSomeWork( int amount )
+{
+	TRACE_BEGIN( work, amount );
+	volatile int i;
+	for( i = 0; i < amount * 100; i++ );
+	TRACE_END( work, amount );
+}
+
+int main()
+{
+	int state = 0;
+
+	SystemInit48HSI();
+	SetupTrace( SYSTEM_CORE_CLOCK );
+
+	// Enable GPIOs
+	RCC->APB2PCENR |= RCC_APB2Periph_GPIOD;
+
+	// GPIO D0 Push-Pull
+	GPIOD->CFGLR &= ~(0xf<<(4*0));
+	GPIOD->CFGLR |= (GPIO_Speed_10MHz | GPIO_CNF_OUT_PP)<<(4*0);
+
+	while(1)
+	{
+		TRACE_EVENT( state_change, state );
+		switch( state )
+		{
+		case 0:
+			GPIOD->BSHR = 1;             // Turn on GPIO
+			DoSomeWork( 10 );
+			state = 1;
+			break;
+		case 1:
+			GPIOD->BSHR = (1<<16);       // Turn off GPIO
+			DoSomeWork( 30 );
+			state = 0;
+			break;
+		}
+	}
+}
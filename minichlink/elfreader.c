@@ -0,0 +1,156 @@
+// Minimal ELF32 reader for pulling symbols and non-loaded sections out of
+// firmware images built with ch32v003fun.
+// Copyright 2023 Charles Lohr, MIT/x11, NewBSD Licenses, or public domain
+// where applicable.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "minichlink.h"
+
+struct ElfFile
+{
+	uint8_t * data;
+	uint32_t len;
+	uint32_t shoff;
+	int shnum;
+	int shentsize;
+	int shstrndx;
+};
+
+static uint32_t ElfR32( const uint8_t * d ) { return d[0] | (d[1]<<8) | (d[2]<<16) | ((uint32_t)d[3]<<24); }
+static uint16_t ElfR16( const uint8_t * d ) { return d[0] | (d[1]<<8); }
+
+// Returns a pointer to the section header, or 0 if out of range.
+static const uint8_t * ElfSectionHeader( struct ElfFile * e, int index )
+{
+	if( index < 0 || index >= e->shnum ) return 0;
+	uint32_t place = e->shoff + index * e->shentsize;
+	if( place + 40 > e->len ) return 0;
+	return e->data + place;
+}
+
+static const char * ElfSectionName( struct ElfFile * e, const uint8_t * sh )
+{
+	const uint8_t * strsh = ElfSectionHeader( e, e->shstrndx );
+	if( !strsh ) return "";
+	uint32_t off = ElfR32( strsh + 16 ) + ElfR32( sh + 0 );
+	if( off >= e->len ) return "";
+	return (const char*)e->data + off;
+}
+
+struct ElfFile * ElfLoad( const char * fname )
+{
+	FILE * f = fopen( fname, "rb" );
+	if( !f )
+	{
+		fprintf( stderr, "Error: can't open ELF file \"%s\"\n", fname );
+		return 0;
+	}
+	fseek( f, 0, SEEK_END );
+	long len = ftell( f );
+	fseek( f, 0, SEEK_SET );
+	struct ElfFile * e = calloc( 1, sizeof( struct ElfFile ) );
+	e->data = malloc( len );
+	e->len = len;
+	if( len < 52 || fread( e->data, len, 1, f ) != 1 )
+	{
+		fclose( f );
+		goto bad;
+	}
+	fclose( f );
+
+	// Must be a 32-bit little-endian ELF.
+	if( memcmp( e->data, "\x7f" "ELF", 4 ) || e->data[4] != 1 || e->data[5] != 1 )
+		goto bad;
+
+	e->shoff = ElfR32( e->data + 32 );
+	e->shentsize = ElfR16( e->data + 46 );
+	e->shnum = ElfR16( e->data + 48 );
+	e->shstrndx = ElfR16( e->data + 50 );
+	if( e->shentsize < 40 || e->shoff + e->shnum * e->shentsize > e->len )
+		goto bad;
+	return e;
+bad:
+	fprintf( stderr, "Error: \"%s\" is not a 32-bit little-endian ELF\n", fname );
+	ElfFree( e );
+	return 0;
+}
+
+void ElfFree( struct ElfFile * e )
+{
+	if( !e ) return;
+	free( e->data );
+	free( e );
+}
+
+const uint8_t * ElfGetSection( struct ElfFile * e, const char * name, uint32_t * address, uint32_t * size )
+{
+	int i;
+	for( i = 0; i < e->shnum; i++ )
+	{
+		const uint8_t * sh = ElfSectionHeader( e, i );
+		if( !sh || strcmp( ElfSectionName( e, sh ), name ) ) continue;
+		uint32_t off = ElfR32( sh + 16 );
+		uint32_t sz = ElfR32( sh + 20 );
+		if( off + sz > e->len ) return 0;
+		if( address ) *address = ElfR32( sh + 12 );
+		if( size ) *size = sz;
+		return e->data + off;
+	}
+	return 0;
+}
+
+// Walks .symtab.  Calls back with each symbol; stops if the callback returns nonzero.
+static int ElfForEachSymbol( struct ElfFile * e, int (*cb)( void * opaque, const char * name, uint32_t value, uint32_t size ), void * opaque )
+{
+	int i;
+	for( i = 0; i < e->shnum; i++ )
+	{
+		const uint8_t * sh = ElfSectionHeader( e, i );
+		if( !sh || ElfR32( sh + 4 ) != 2 ) continue; // SHT_SYMTAB
+		const uint8_t * strsh = ElfSectionHeader( e, ElfR32( sh + 24 ) ); // sh_link -> .strtab
+		if( !strsh ) return 0;
+		uint32_t symoff = ElfR32( sh + 16 );
+		uint32_t symsize = ElfR32( sh + 20 );
+		uint32_t entsize = ElfR32( sh + 36 );
+		uint32_t stroff = ElfR32( strsh + 16 );
+		uint32_t strsize = ElfR32( strsh + 20 );
+		if( entsize < 16 || symoff + symsize > e->len || stroff + strsize > e->len ) return 0;
+		uint32_t s;
+		for( s = 0; s + entsize <= symsize; s += entsize )
+		{
+			const uint8_t * sym = e->data + symoff + s;
+			uint32_t nameoff = ElfR32( sym + 0 );
+			if( nameoff == 0 || nameoff >= strsize ) continue;
+			int r = cb( opaque, (const char*)e->data + stroff + nameoff, ElfR32( sym + 4 ), ElfR32( sym + 8 ) );
+			if( r ) return r;
+		}
+	}
+	return 0;
+}
+
+struct ElfSymbolSearch
+{
+	const char * name;
+	uint32_t value;
+	uint32_t size;
+};
+
+static int ElfMatchName( void * opaque, const char * name, uint32_t value, uint32_t size )
+{
+	struct ElfSymbolSearch * s = opaque;
+	if( strcmp( name, s->name ) ) return 0;
+	s->value = value;
+	s->size = size;
+	return 1;
+}
+
+int ElfFindSymbol( struct ElfFile * e, const char * name, uint32_t * value, uint32_t * size )
+{
+	struct ElfSymbolSearch s = { name, 0, 0 };
+	if( !ElfForEachSymbol( e, ElfMatchName, &s ) ) return -1;
+	if( value ) *value = s.value;
+	if( size ) *size = s.size;
+	return 0;
+}
@@ -0,0 +1,66 @@
+#ifndef _MINICHLINK_INTERNAL_H
+#define _MINICHLINK_INTERNAL_H
+
+// Shared by minichlink and its programmer drivers only.  Library users get
+// struct InternalState as an opaque type from minichlink.h, so it can change
+// without MINICHLINK_API_VERSION changing.
+
+#include "minichlink.h"
+
+// What a programmer can do natively, and roughly what it costs, so the high
+// level functions can send each request down the fastest path.  Programmers
+// fill these in from TryInit; SetupAutomaticHighLevelFunctions guesses at
+// anything left 0.
+#define MCAP_BLOCK_WRITE64 (1<<0) // BlockWrite64 erases and programs a whole flash page by itself.
+#define MCAP_BLOCK_READ    (1<<1) // ReadBinaryBlob is native, not built on ReadWord.
+#define MCAP_QUEUED_DMI    (1<<2) // Register writes are batched, and only go out on a read or flush.
+#define MCAP_BLOCK_READ64  (1<<4) // BlockRead64 is native.
+
+struct MiniChlinkCapabilities
+{
+	uint32_t flags;
+	// Rough costs, in us, as seen from the host.
+	uint32_t dmi_read_us;    // One ReadReg32.
+	uint32_t word_read_us;   // One ReadWord, in a run of them.
+	uint32_t block_write_us; // One BlockWrite64, erase included.
+	uint32_t block_read_us;  // One 64-byte block of a BlockRead64.
+	uint32_t page_write_us;  // Erasing then programming one page with WriteWord.
+};
+
+#define SEMIHOST_MAX_FILES 16
+
+struct InternalState
+{
+	uint32_t statetag;
+	uint32_t currentstateval;
+	uint32_t flash_unlocked;
+	int lastwriteflags;
+	int processor_in_mode;
+	int verify_writes;
+	uint32_t write_checkpoint; // First address of the current blob write not yet confirmed good.
+	// What the edge pages of the current blob write held before it erased
+	// anything, for a resumed write to merge with instead of erased flash.
+	// write_bg_page is 1 (never a page address) for an unused slot.
+	int write_resuming;
+	uint32_t write_bg_page[2];
+	uint8_t write_bg[2][64];
+	uint32_t erase_access_us; // One register access, timed by the erase planner.  0 until then.
+	struct MiniChlinkCapabilities caps;
+	FILE * semihost_files[SEMIHOST_MAX_FILES]; // By the part's fd.  0-2 are stdio.
+
+	// Each handle carries its own function table, see MCF below.
+	struct MiniChlinkFunctions functions;
+	void * lock;
+};
+
+// The function table belongs to the handle, so anywhere MCF is used there must
+// be a 'dev' in scope.  There are no globals, so separate handles can be used
+// from separate threads.
+#define MCF (((struct ProgrammerStructBase*)dev)->internal->functions)
+
+// Returns 'dev' on success, else 0.  iss becomes dev's internal state.  index
+// picks which of several attached programmers of that kind to use, from 0.
+void * TryInit_WCHLinkE( struct InternalState * iss, int index );
+void * TryInit_ESP32S2CHFUN( struct InternalState * iss, int index );
+
+#endif
@@ -8,34 +8,53 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
-#include "minichlink.h"
+#include <signal.h>
+#include "minichlink-internal.h"
 #include "../ch32v003fun/ch32v003fun.h"
 
-static int64_t StringToMemoryAddress( const char * number );
 static void StaticUpdatePROGBUFRegs( void * dev );
+#ifndef MINICHLINK_AS_LIBRARY
+static int64_t StringToMemoryAddress( const char * number );
 static int InternalUnlockBootloader( void * dev );
+static int InternalTraceCapture( void * dev, const char * elffile, const char * outfile );
+static int InternalDiff( void * dev, const char * fname, uint32_t address );
+static int InternalWriteWithResume( void * dev, uint32_t address, uint32_t len, uint8_t * image );
+static int InternalTimeFunction( void * dev, const char * elffile, const char * symbol, int calls );
+static int InternalWatch( void * dev, uint32_t address, int match_bits, int stop, int hits, int timeout_s );
+struct DLogDecoder;
+static int InternalTerminal( void * dev, int semihost, struct DLogDecoder * dlog );
+static int InternalDLogDecodeFile( const char * elffile, const char * capture );
+static struct DLogDecoder * InternalDLogOpen( const char * elffile );
+static int InternalBulkOp( void * dev, const char * op, uint32_t a, uint32_t b, uint32_t c );
+#endif
+int DefaultWriteBinaryBlob( void * dev, uint32_t address_to_write, uint32_t blob_size, uint8_t * blob );
+static int DefaultReadWord( void * dev, uint32_t address_to_read, uint32_t * data );
+int DefaultErase( void * dev, uint32_t address, uint32_t length, int type );
+static uint64_t InternalTimeUS();
 
 void TestFunction(void * v );
-struct MiniChlinkFunctions MCF;
 
+#ifndef MINICHLINK_AS_LIBRARY
 int main( int argc, char ** argv )
 {
-	void * dev = 0;
-	if( (dev = TryInit_WCHLinkE()) )
+	// Decoding a capture of deferred logs doesn't need a programmer.
+	if( argc == 4 && strcmp( argv[1], "--dlog-decode" ) == 0 )
+		return InternalDLogDecodeFile( argv[2], argv[3] );
+
+	// --programmer has to come first, since the programmer is opened before the
+	// rest of the commands are looked at.
+	const char * selector = 0;
+	if( argc > 2 && strcmp( argv[1], "--programmer" ) == 0 )
 	{
-		fprintf( stderr, "Found WCH LinkE\n" );
-	}
-	else if( (dev = TryInit_ESP32S2CHFUN()) )
-	{
-		fprintf( stderr, "Found ESP32S2 Programmer\n" );
+		selector = argv[2];
+		argv[2] = argv[0];
+		argv += 2;
+		argc -= 2;
 	}
-	else
-	{
-		fprintf( stderr, "Error: Could not initialize any supported programmers\n" );
+
+	void * dev = MiniChlinkOpen( selector );
+	if( !dev )
 		return -32;
-	}
-	
-	SetupAutomaticHighLevelFunctions( dev );
 
 	int status;
 	int must_be_end = 0;
@@ -46,12 +65,13 @@ int main( int argc, char ** argv )
 
 	if( !skip_startup && MCF.SetupInterface )
 	{
+		uint64_t attach_start = InternalTimeUS();
 		if( MCF.SetupInterface( dev ) < 0 )
 		{
 			fprintf( stderr, "Could not setup interface.\n" );
 			return -33;
 		}
-		printf( "Interface Setup\n" );
+		printf( "Interface Setup (%d ms)\n", (int)( ( InternalTimeUS() - attach_start ) / 1000 ) );
 	}
 
 //	TestFunction( dev );
@@ -136,6 +156,9 @@ keep_going:
 				if( !MCF.HaltMode || MCF.HaltMode( dev, 0 ) )
 					goto unimplemented;
 				break;
+			case 'v':  // Verify everything written after this.
+				((struct ProgrammerStructBase*)dev)->internal->verify_writes = 1;
+				break;
 
 			// disable NRST pin (turn it into a GPIO)
 			case 'd':  // see "RSTMODE" in datasheet
@@ -156,20 +179,7 @@ keep_going:
 			{
 				if( !MCF.PollTerminal )
 					goto unimplemented;
-				do
-				{
-					uint8_t buffer[256];
-					int r = MCF.PollTerminal( dev, buffer, sizeof( buffer ), 0, 0 );
-					if( r < 0 )
-					{
-						fprintf( stderr, "Terminal dead.  code %d\n", r );
-						return -32;
-					}
-					if( r > 0 )
-					{
-						fwrite( buffer, r, 1, stdout ); 
-					}
-				} while( 1 );
+				return InternalTerminal( dev, 0, 0 );
 			}
 			case 'p':
 			{
@@ -270,6 +280,152 @@ keep_going:
 				if( f != stdout ) fclose( f );
 				break;
 			}
+			case '-':
+			{
+				// Long commands, these cannot be combined.
+				argchar = 0;
+				if( strcmp( lastcommand, "--trace" ) == 0 )
+				{
+					if( iarg + 2 >= argc )
+					{
+						fprintf( stderr, "Error: --trace needs an ELF file and an output file.\n" );
+						goto help;
+					}
+					// Like -T, this never returns.
+					return InternalTraceCapture( dev, argv[iarg+1], argv[iarg+2] );
+				}
+				else if( strcmp( lastcommand, "--diff" ) == 0 )
+				{
+					if( iarg + 2 >= argc )
+					{
+						fprintf( stderr, "Error: --diff needs a file and an address.\n" );
+						goto help;
+					}
+					if( MCF.HaltMode ) MCF.HaltMode( dev, 0 );
+					uint64_t offset = StringToMemoryAddress( argv[iarg+2] );
+					if( offset > 0xffffffff )
+					{
+						fprintf( stderr, "Error: Invalid offset (%s)\n", argv[iarg+2] );
+						return -44;
+					}
+					int r = InternalDiff( dev, argv[iarg+1], offset );
+					if( r < 0 ) return r;
+					iarg += 2;
+					break;
+				}
+				else if( strcmp( lastcommand, "--fill" ) == 0 || strcmp( lastcommand, "--copy" ) == 0 || strcmp( lastcommand, "--cmp" ) == 0 )
+				{
+					int64_t p[3];
+					int i;
+					if( iarg + 3 >= argc )
+					{
+						fprintf( stderr, "Error: %s needs three parameters.\n", lastcommand );
+						goto help;
+					}
+					for( i = 0; i < 3; i++ )
+					{
+						p[i] = StringToMemoryAddress( argv[iarg+1+i] );
+						if( p[i] < 0 || p[i] > 0xffffffff )
+						{
+							fprintf( stderr, "Error: Invalid parameter (%s)\n", argv[iarg+1+i] );
+							return -44;
+						}
+					}
+					if( MCF.HaltMode ) MCF.HaltMode( dev, 0 );
+					int r = InternalBulkOp( dev, lastcommand + 2, p[0], p[1], p[2] );
+					if( r ) return r;
+					iarg += 3;
+					break;
+				}
+				else if( strcmp( lastcommand, "--time-fn" ) == 0 )
+				{
+					if( iarg + 2 >= argc )
+					{
+						fprintf( stderr, "Error: --time-fn needs an ELF file and a function name.\n" );
+						goto help;
+					}
+					int calls = 16;
+					const char * elffile = argv[iarg+1];
+					const char * symbol = argv[iarg+2];
+					iarg += 2;
+					if( iarg + 1 < argc && argv[iarg+1][0] != '-' )
+						calls = SimpleReadNumberInt( argv[++iarg], 16 );
+					int r = InternalTimeFunction( dev, elffile, symbol, calls );
+					if( r ) return r;
+					break;
+				}
+				else if( strcmp( lastcommand, "--semihost" ) == 0 )
+				{
+					if( !MCF.PollTerminal )
+						goto unimplemented;
+					return InternalTerminal( dev, 1, 0 );
+				}
+				else if( strcmp( lastcommand, "--dlog" ) == 0 )
+				{
+					struct DLogDecoder * dl;
+					if( iarg + 1 >= argc )
+					{
+						fprintf( stderr, "Error: --dlog needs the firmware's ELF file.\n" );
+						goto help;
+					}
+					if( !MCF.PollTerminal )
+						goto unimplemented;
+					if( !( dl = InternalDLogOpen( argv[iarg+1] ) ) )
+						return -9;
+					return InternalTerminal( dev, 0, dl );
+				}
+				else if( strcmp( lastcommand, "--watch" ) == 0 )
+				{
+					if( iarg + 1 >= argc )
+					{
+						fprintf( stderr, "Error: --watch needs an address.\n" );
+						goto help;
+					}
+					const char * target = argv[++iarg];
+					int64_t address = -1;
+					const char * elfsep = strstr( target, ".elf:" );
+					if( elfsep )
+					{
+						// firmware.elf:symbol
+						char * elffile = strdup( target );
+						elffile[elfsep - target + 4] = 0;
+						struct ElfFile * e = ElfLoad( elffile );
+						uint32_t value;
+						if( e && ElfFindSymbol( e, elfsep + 5, &value, 0 ) == 0 )
+							address = value;
+						ElfFree( e );
+						free( elffile );
+					}
+					else
+						address = StringToMemoryAddress( target );
+					if( address < 0 || address > 0xffffffff )
+					{
+						fprintf( stderr, "Error: Can't find address to watch (%s)\n", target );
+						return -9;
+					}
+
+					int match_bits = 2; // Stores
+					int stop = 0;
+					int hits = 100;
+					int timeout_s = 60;
+					while( iarg + 1 < argc && argv[iarg+1][0] != '-' )
+					{
+						const char * opt = argv[++iarg];
+						if( strcmp( opt, "r" ) == 0 ) match_bits = 1;
+						else if( strcmp( opt, "w" ) == 0 ) match_bits = 2;
+						else if( strcmp( opt, "rw" ) == 0 ) match_bits = 3;
+						else if( strcmp( opt, "stop" ) == 0 ) stop = 1;
+						else if( strcmp( opt, "count" ) == 0 ) stop = 0;
+						else if( opt[0] && opt[strlen( opt ) - 1] == 's' ) timeout_s = atoi( opt ); // e.g. 30s
+						else hits = SimpleReadNumberInt( opt, hits );
+					}
+					int r = InternalWatch( dev, address, match_bits, stop, hits, timeout_s );
+					if( r ) return r;
+					break;
+				}
+				fprintf( stderr, "Error: Unknown command %s\n", lastcommand );
+				goto help;
+			}
 			case 'w':
 			{
 				if( MCF.HaltMode ) MCF.HaltMode( dev, 0 );
@@ -358,11 +514,25 @@ keep_going:
 
 				if( MCF.WriteBinaryBlob )
 				{
-					if( MCF.WriteBinaryBlob( dev, offset, len, image ) )
+					if( InternalWriteWithResume( dev, offset, len, image ) )
 					{
 						fprintf( stderr, "Error: Fault writing image.\n" );
 						return -13;
 					}
+
+					// The default writer verifies as it goes, anything else gets read back here.
+					if( ((struct ProgrammerStructBase*)dev)->internal->verify_writes && MCF.WriteBinaryBlob != DefaultWriteBinaryBlob )
+					{
+						uint8_t * readback = malloc( len );
+						if( !MCF.ReadBinaryBlob || MCF.ReadBinaryBlob( dev, offset, len, readback ) || memcmp( readback, image, len ) )
+						{
+							fprintf( stderr, "Error: Image failed verify.\n" );
+							free( readback );
+							return -14;
+						}
+						free( readback );
+						printf( "Image verified.\n" );
+					}
 				}
 				else
 				{
@@ -379,11 +549,7 @@ keep_going:
 		if( argchar && argchar[2] != 0 ) { argchar++; goto keep_going; }
 	}
 
-	if( MCF.FlushLLCommands )
-		MCF.FlushLLCommands( dev );
-
-	if( MCF.Exit )
-		MCF.Exit( dev );
+	MiniChlinkClose( dev );
 
 	return 0;
 
@@ -391,6 +557,7 @@ help:
 	fprintf( stderr, "Usage: minichlink [args]\n" );
 	fprintf( stderr, " single-letter args may be combined, i.e. -3r\n" );
 	fprintf( stderr, " multi-part args cannot.\n" );
+	fprintf( stderr, " --programmer [linke|esp32s2][:n] Must come first.  Use the n'th programmer of that kind\n" );
 	fprintf( stderr, " -3 Enable 3.3V\n" );
 	fprintf( stderr, " -5 Enable 5V\n" );
 	fprintf( stderr, " -t Disable 3.3V\n" );
@@ -403,11 +570,22 @@ help:
 	fprintf( stderr, " -d Configure NRST as NRST\n" );
 //	fprintf( stderr, " -P Enable Read Protection (UNTESTED)\n" );
 //	fprintf( stderr, " -p Disable Read Protection (UNTESTED)\n" );
+	fprintf( stderr, " -v Verify writes that follow by reading them back\n" );
 	fprintf( stderr, " -w [binary image to write] [address, decimal or 0x, try0x08000000]\n" );
 	fprintf( stderr, " -r [output binary image] [memory address, decimal or 0x, try 0x08000000] [size, decimal or 0x, try 16384]\n" );
 	fprintf( stderr, "   Note: for memory addresses, you can use 'flash' 'launcher' 'bootloader' 'option' 'ram' and say \"ram+0x10\" for instance\n" );
 	fprintf( stderr, "   For filename, you can use - for raw or + for hex.\n" );
 	fprintf( stderr, " -T is a terminal. This MUST be the last argument.  You MUST have resumed or \n" );
+	fprintf( stderr, " --diff [binary image] [address] Show which byte ranges on the part differ from the image\n" );
+	fprintf( stderr, " --time-fn [firmware .elf] [function] [calls, default 16] Time calls to a function using hardware triggers\n" );
+	fprintf( stderr, " --fill [address] [length] [word] Fill memory with a 32-bit pattern, run on the part\n" );
+	fprintf( stderr, " --copy [from] [to] [length] Copy memory, run on the part\n" );
+	fprintf( stderr, " --cmp [address] [address] [length] Compare memory, run on the part\n" );
+	fprintf( stderr, " --dlog [firmware .elf] Like -T, but formats DLOG() messages using the ELF\n" );
+	fprintf( stderr, " --dlog-decode [firmware .elf] [capture] Format DLOG() messages from a file or tty, e.g. the UART (must be the only option)\n" );
+	fprintf( stderr, " --semihost Like -T, but also services semihosting calls (file I/O) from the part\n" );
+	fprintf( stderr, " --watch [address or firmware.elf:symbol] [r|w|rw] [count|stop] [hits, default 100] [timeout, default 60s] Watchpoint, logs PC and value\n" );
+	fprintf( stderr, " --trace [firmware .elf] [output .json] Stream TRACE_EVENT()s into a Chrome/Perfetto trace.  MUST be the last argument.\n" );
 
 	return -1;	
 
@@ -415,10 +593,49 @@ unimplemented:
 	fprintf( stderr, "Error: Command '%s' unimplemented on this programmer.\n", lastcommand );
 	return -1;
 }
+#endif
 
 
 #if defined(WINDOWS) || defined(WIN32) || defined(_WIN32)
 #define strtoll _strtoi64
+#include <windows.h>
+static inline void InternalSleepMS( int ms ) { Sleep( ms ); }
+static void * InternalLockCreate()
+{
+	CRITICAL_SECTION * cs = malloc( sizeof( CRITICAL_SECTION ) );
+	InitializeCriticalSection( cs );
+	return cs;
+}
+static void InternalLockDestroy( void * l ) { DeleteCriticalSection( l ); free( l ); }
+static void InternalLockTake( void * l ) { EnterCriticalSection( l ); }
+static void InternalLockRelease( void * l ) { LeaveCriticalSection( l ); }
+static uint64_t InternalTimeUS()
+{
+	LARGE_INTEGER freq, now;
+	QueryPerformanceFrequency( &freq );
+	QueryPerformanceCounter( &now );
+	return now.QuadPart * 1000000ULL / freq.QuadPart;
+}
+#else
+#include <unistd.h>
+#include <sys/time.h>
+#include <pthread.h>
+static inline void InternalSleepMS( int ms ) { usleep( ms * 1000 ); }
+static void * InternalLockCreate()
+{
+	pthread_mutex_t * m = malloc( sizeof( pthread_mutex_t ) );
+	pthread_mutex_init( m, 0 );
+	return m;
+}
+static void InternalLockDestroy( void * l ) { pthread_mutex_destroy( l ); free( l ); }
+static void InternalLockTake( void * l ) { pthread_mutex_lock( l ); }
+static void InternalLockRelease( void * l ) { pthread_mutex_unlock( l ); }
+static uint64_t InternalTimeUS()
+{
+	struct timeval tv;
+	gettimeofday( &tv, 0 );
+	return tv.tv_sec * 1000000ULL + tv.tv_usec;
+}
 #endif
 
 static int StaticUnlockFlash( void * dev, struct InternalState * iss );
@@ -448,6 +665,7 @@ int64_t SimpleReadNumberInt( const char * number, int64_t defaultNumber )
 	}
 }
 
+#ifndef MINICHLINK_AS_LIBRARY
 static int64_t StringToMemoryAddress( const char * number )
 {
 	uint32_t base = 0;
@@ -468,6 +686,7 @@ static int64_t StringToMemoryAddress( const char * number )
 	}
 	return SimpleReadNumberInt( number, -1 );
 }
+#endif
 
 static int DefaultWaitForFlash( void * dev )
 {
@@ -512,33 +731,54 @@ int DefaultSetupInterface( void * dev )
 	struct InternalState * iss = (struct InternalState*)(((struct ProgrammerStructBase*)dev)->internal);
 
 	if( MCF.Control3v3 ) MCF.Control3v3( dev, 1 );
-	if( MCF.DelayUS ) MCF.DelayUS( dev, 16000 );
-	MCF.WriteReg32( dev, DMSHDWCFGR, 0x5aa50000 | (1<<10) ); // Shadow Config Reg
-	MCF.WriteReg32( dev, DMCFGR, 0x5aa50000 | (1<<10) ); // CFGR (1<<10 == Allow output from slave)
-	MCF.WriteReg32( dev, DMCFGR, 0x5aa50000 | (1<<10) ); // Bug in silicon?  If coming out of cold boot, and we don't do our little "song and dance" this has to be called.
 
-	// Read back chip status.  This is really basic.
+	// Instead of sleeping a fixed 16ms for the part to come up, configure the
+	// debug module and poll DMSTATUS until it reports a 0.13 debug module
+	// (version field, bits 0..3, of 2), backing off a little more each time.
+	// Coming out of a cold boot the DMCFGR write can get lost, so a status that
+	// reads back but isn't valid gets it written again; a failed read doesn't.
 	uint32_t reg = 0;
-	int r = MCF.ReadReg32( dev, DMSTATUS, &reg );
-	if( r >= 0 )
+	uint32_t backoff = 250;
+	int r;
+	int tries;
+	MCF.WriteReg32( dev, DMSHDWCFGR, 0x5aa50000 | (1<<10) ); // Shadow Config Reg
+	MCF.WriteReg32( dev, DMCFGR, 0x5aa50000 | (1<<10) ); // CFGR (1<<10 == Allow output from slave)
+	for( tries = 0; ; tries++ )
 	{
-		// Valid R.
-		if( reg == 0x00000000 || reg == 0xffffffff )
-		{
-			fprintf( stderr, "Error: Setup chip failed. Got code %08x\n", reg );
-			return -9;
-		}
+		r = MCF.ReadReg32( dev, DMSTATUS, &reg );
+		if( ( r >= 0 && ( reg & 0xf ) == 2 ) || tries == 20 )
+			break;
+		if( MCF.DelayUS ) MCF.DelayUS( dev, backoff );
+		if( backoff < 4000 ) backoff *= 2;
+		if( r >= 0 )
+			MCF.WriteReg32( dev, DMCFGR, 0x5aa50000 | (1<<10) );
 	}
-	else
+
+	if( r < 0 )
 	{
 		fprintf( stderr, "Error: Could not read chip code.\n" );
 		return r;
 	}
+	if( ( reg & 0xf ) != 2 )
+	{
+		fprintf( stderr, "Error: Setup chip failed. Got code %08x\n", reg );
+		return -9;
+	}
 
 	iss->statetag = STTAG( "STRT" );
 	return 0;
 }
 
+// x10..x13 are left alone by all of the sequential read/write programs, so if
+// we're in one of those states they don't need loading again.
+static int StaticPROGBUFRegsValid( struct InternalState * iss )
+{
+	return iss->statetag == STTAG( "WRSQ" ) || iss->statetag == STTAG( "RDSQ" ) ||
+		iss->statetag == STTAG( "WRS2" ) || iss->statetag == STTAG( "RDS2" ) ||
+		iss->statetag == STTAG( "WRSB" ) || iss->statetag == STTAG( "RDSB" ) ||
+		iss->statetag == STTAG( "WRSH" ) || iss->statetag == STTAG( "RDSH" );
+}
+
 static void StaticUpdatePROGBUFRegs( void * dev )
 {
 	MCF.WriteReg32( dev, DMDATA0, 0xe00000f4 );   // DATA0's location in memory.
@@ -551,6 +791,7 @@ static void StaticUpdatePROGBUFRegs( void * dev )
 	MCF.WriteReg32( dev, DMCOMMAND, 0x0023100d ); // Copy data to x13
 }
 
+#ifndef MINICHLINK_AS_LIBRARY
 static int InternalUnlockBootloader( void * dev )
 {
 	if( !MCF.WriteWord ) return -99;
@@ -574,59 +815,112 @@ static int InternalUnlockBootloader( void * dev )
 	printf( "FLASH_OBTKEYR = %08x (%d)\n", OBTKEYR, ret );
 	return ret;
 }
+#endif
 
 
 
-static int DefaultWriteHalfWord( void * dev, uint32_t address_to_write, uint32_t data )
+// Byte and half-word streaming.  Same idea as DefaultWriteWord / DefaultReadWord:
+// the address lives in DATA1 and moves along by itself, and autoexec reruns the
+// program on every DATA0 access, so a run of sequential accesses is one DMI op each.
+static int InternalWriteNarrow( void * dev, uint32_t address_to_write, uint32_t data, int width )
 {
-	int ret = 0;
 	struct InternalState * iss = (struct InternalState*)(((struct ProgrammerStructBase*)dev)->internal);
-	if( MCF.VoidHighLevelState ) MCF.VoidHighLevelState( dev );
-	iss->statetag = STTAG( "XXXX" );
+	uint32_t tag = ( width == 1 ) ? STTAG( "WRSB" ) : STTAG( "WRSH" );
 
-	MCF.WriteReg32( dev, DMABSTRACTAUTO, 0x00000000 ); // Disable Autoexec.
+	if( iss->statetag != tag )
+	{
+		if( MCF.VoidHighLevelState ) MCF.VoidHighLevelState( dev );
+		MCF.WriteReg32( dev, DMABSTRACTAUTO, 0 ); // Disable Autoexec.
+		// c.lw x9,0(x11) // Get the address to write to.
+		// sb x8,0(x9) or sh x8,0(x9)
+		// c.addi x9, 1 or 2
+		// c.sw x9,0(x11)
+		// c.ebreak
+		MCF.WriteReg32( dev, DMPROGBUF0, ( width == 1 ) ? 0x80234184 : 0x90234184 );
+		MCF.WriteReg32( dev, DMPROGBUF1, ( width == 1 ) ? 0x04850084 : 0x04890084 );
+		MCF.WriteReg32( dev, DMPROGBUF2, 0x9002c184 );
+		if( !StaticPROGBUFRegsValid( iss ) )
+			StaticUpdatePROGBUFRegs( dev );
 
-	// Different address, so we don't need to re-write all the program regs.
-	// sh x8,0(x9)  // Write to the address.
-	MCF.WriteReg32( dev, DMPROGBUF0, 0x00849023 );
-	MCF.WriteReg32( dev, DMPROGBUF1, 0x00100073 ); // c.ebreak
+		MCF.WriteReg32( dev, DMDATA1, address_to_write );
+		MCF.WriteReg32( dev, DMDATA0, data );
+		MCF.WriteReg32( dev, DMCOMMAND, 0x00271008 ); // Copy data to x8, and execute program.
+		MCF.WriteReg32( dev, DMABSTRACTAUTO, 1 ); // Enable Autoexec.
+		iss->statetag = tag;
+	}
+	else
+	{
+		if( address_to_write != iss->currentstateval )
+		{
+			MCF.WriteReg32( dev, DMABSTRACTAUTO, 0 ); // Disable Autoexec.
+			MCF.WriteReg32( dev, DMDATA1, address_to_write );
+			MCF.WriteReg32( dev, DMABSTRACTAUTO, 1 ); // Enable Autoexec.
+		}
+		MCF.WriteReg32( dev, DMDATA0, data );
+	}
+	iss->currentstateval = address_to_write + width;
+	return MCF.WaitForDoneOp( dev );
+}
 
-	MCF.WriteReg32( dev, DMDATA0, address_to_write );
-	MCF.WriteReg32( dev, DMCOMMAND, 0x00231009 ); // Copy data to x9
-	MCF.WriteReg32( dev, DMDATA0, data );
-	MCF.WriteReg32( dev, DMCOMMAND, 0x00271008 ); // Copy data to x8, and execute program.
+static int InternalReadNarrow( void * dev, uint32_t address_to_read, uint32_t * data, int width )
+{
+	struct InternalState * iss = (struct InternalState*)(((struct ProgrammerStructBase*)dev)->internal);
+	uint32_t tag = ( width == 1 ) ? STTAG( "RDSB" ) : STTAG( "RDSH" );
 
-	ret |= MCF.WaitForDoneOp( dev );
-	iss->currentstateval = -1;
+	if( iss->statetag != tag || address_to_read != iss->currentstateval )
+	{
+		if( iss->statetag != tag )
+		{
+			if( MCF.VoidHighLevelState ) MCF.VoidHighLevelState( dev );
+			MCF.WriteReg32( dev, DMABSTRACTAUTO, 0 ); // Disable Autoexec.
+			// c.lw x8,0(x11) // Pull the address from DATA1
+			// lbu x9,0(x8) or lhu x9,0(x8)
+			// c.addi x8, 1 or 2
+			// c.sw x9, 0(x10) // Write back to DATA0
+			// c.sw x8, 0(x11) // Write addy to DATA1
+			// c.ebreak
+			MCF.WriteReg32( dev, DMPROGBUF0, ( width == 1 ) ? 0x44834180 : 0x54834180 );
+			MCF.WriteReg32( dev, DMPROGBUF1, ( width == 1 ) ? 0x04050004 : 0x04090004 );
+			MCF.WriteReg32( dev, DMPROGBUF2, 0xc180c104 );
+			MCF.WriteReg32( dev, DMPROGBUF3, 0x00009002 );
+			if( !StaticPROGBUFRegsValid( iss ) )
+				StaticUpdatePROGBUFRegs( dev );
+			MCF.WriteReg32( dev, DMABSTRACTAUTO, 1 ); // Enable Autoexec.
+		}
 
+		MCF.WriteReg32( dev, DMDATA1, address_to_read );
+		MCF.WriteReg32( dev, DMCOMMAND, 0x00241000 ); // Only execute.
 
-	return ret;
-}
+		iss->statetag = tag;
+		iss->currentstateval = address_to_read;
 
-static int DefaultReadHalfWord( void * dev, uint32_t address_to_write, uint32_t * data )
-{
-	int ret = 0;
-	struct InternalState * iss = (struct InternalState*)(((struct ProgrammerStructBase*)dev)->internal);
-	if( MCF.VoidHighLevelState ) MCF.VoidHighLevelState( dev );
-	iss->statetag = STTAG( "XXXX" );
+		MCF.WaitForDoneOp( dev );
+	}
 
-	MCF.WriteReg32( dev, DMABSTRACTAUTO, 0x00000000 ); // Disable Autoexec.
+	// Reading DATA0 sets off the next read already.
+	iss->currentstateval += width;
 
-	// Different address, so we don't need to re-write all the program regs.
-	// lh x8,0(x9)  // Write to the address.
-	MCF.WriteReg32( dev, DMPROGBUF0, 0x00049403 );
-	MCF.WriteReg32( dev, DMPROGBUF1, 0x00100073 ); // c.ebreak
+	return MCF.ReadReg32( dev, DMDATA0, data );
+}
 
-	MCF.WriteReg32( dev, DMDATA0, address_to_write );
-	MCF.WriteReg32( dev, DMCOMMAND, 0x00231009 ); // Copy data to x9
-	MCF.WriteReg32( dev, DMCOMMAND, 0x00241000 ); // Only execute.
-	MCF.WriteReg32( dev, DMCOMMAND, 0x00221008 ); // Read x8 into DATA0.
+static int DefaultWriteHalfWord( void * dev, uint32_t address_to_write, uint32_t data )
+{
+	return InternalWriteNarrow( dev, address_to_write, data & 0xffff, 2 );
+}
 
-	ret |= MCF.WaitForDoneOp( dev );
-	iss->currentstateval = -1;
+static int DefaultReadHalfWord( void * dev, uint32_t address_to_read, uint32_t * data )
+{
+	return InternalReadNarrow( dev, address_to_read, data, 2 );
+}
 
+static int DefaultWriteByte( void * dev, uint32_t address_to_write, uint32_t data )
+{
+	return InternalWriteNarrow( dev, address_to_write, data & 0xff, 1 );
+}
 
-	return ret | MCF.ReadReg32( dev, DMDATA0, data );
+static int DefaultReadByte( void * dev, uint32_t address_to_read, uint32_t * data )
+{
+	return InternalReadNarrow( dev, address_to_read, data, 1 );
 }
 
 
@@ -657,7 +951,7 @@ static int DefaultWriteWord( void * dev, uint32_t address_to_write, uint32_t dat
 			// c.sw x9,0(x11)
 			MCF.WriteReg32( dev, DMPROGBUF1, 0xc1840491 );
 
-			if( iss->statetag != STTAG( "RDSQ" ) )
+			if( !StaticPROGBUFRegsValid( iss ) )
 			{
 				StaticUpdatePROGBUFRegs( dev );
 			}
@@ -724,115 +1018,496 @@ static int DefaultWriteWord( void * dev, uint32_t address_to_write, uint32_t dat
 }
 
 
-int DefaultWriteBinaryBlob( void * dev, uint32_t address_to_write, uint32_t blob_size, uint8_t * blob )
+// Streams pairs of words to sequential addresses, 8 bytes per execute.  The
+// pointer is kept in x9 on the hart so DATA1 is free to carry payload too.
+// Only for programmers using DefaultWriteWord; anything that keeps its own
+// idea of what's in PROGBUF is voided first, but it would gain nothing.
+static int InternalWriteWordsDual( void * dev, uint32_t address_to_write, int pairs, const uint8_t * data )
 {
-	// NOTE IF YOU FIX SOMETHING IN THIS FUNCTION PLEASE ALSO UPDATE THE PROGRAMMERS.
-	//  this is only fallback functionality for really realy basic programmers.
-
-	uint32_t rw;
 	struct InternalState * iss = (struct InternalState*)(((struct ProgrammerStructBase*)dev)->internal);
-	int is_flash = 0;
-
-	if( blob_size == 0 ) return 0;
+	uint32_t w[2];
+	int ret = 0;
+	int i = 0;
 
-	if( (address_to_write & 0xff000000) == 0x08000000 || (address_to_write & 0xff000000) == 0x00000000 || (address_to_write & 0x1FFFF800) == 0x1FFFF000 ) 
+	int is_flash = 0;
+	if( ( address_to_write & 0xff000000 ) == 0x08000000 || ( address_to_write & 0x1FFFF800 ) == 0x1FFFF000 )
 		is_flash = 1;
 
-	if( is_flash && MCF.BlockWrite64 && ( address_to_write & 0x3f ) == 0 )
+	if( pairs <= 0 ) return 0;
+
+	if( iss->statetag != STTAG( "WRS2" ) || is_flash != iss->lastwriteflags || address_to_write != iss->currentstateval )
 	{
-		int i;
-		for( i = 0; i < blob_size; i+= 64 )
+		if( iss->statetag != STTAG( "WRS2" ) && MCF.VoidHighLevelState ) MCF.VoidHighLevelState( dev );
+		MCF.WriteReg32( dev, DMABSTRACTAUTO, 0x00000000 ); // Disable Autoexec.
+		if( iss->statetag != STTAG( "WRS2" ) || is_flash != iss->lastwriteflags )
 		{
-			int r = MCF.BlockWrite64( dev, address_to_write + i, blob + i );
-			if( r )
+			if( is_flash )
 			{
-				fprintf( stderr, "Error writing block at memory %08x\n", address_to_write );
-				return r;
+				// Same as below, but each word is followed by a buffer load, and
+				// we wait for BSY (FLASH->STATR, just before x12) to clear.
+				// c.sw x8,0(x9)
+				// c.sw x13,0(x12)
+				MCF.WriteReg32( dev, DMPROGBUF0, 0xc214c080 );
+				// 1: lw x8,-4(x12)
+				MCF.WriteReg32( dev, DMPROGBUF1, 0xffc62403 );
+				// c.andi x8, 1
+				// c.bnez x8, 1b
+				MCF.WriteReg32( dev, DMPROGBUF2, 0xfc6d8805 );
+				// c.lw x8,0(x11)
+				// c.sw x8,4(x9)
+				MCF.WriteReg32( dev, DMPROGBUF3, 0xc0c04180 );
+				// c.sw x13,0(x12)
+				// 2: lw x8,-4(x12)  (straddles PROGBUF4/5)
+				MCF.WriteReg32( dev, DMPROGBUF4, 0x2403c214 );
+				// c.andi x8, 1
+				MCF.WriteReg32( dev, DMPROGBUF5, 0x8805ffc6 );
+				// c.bnez x8, 2b
+				// c.addi x9, 8
+				MCF.WriteReg32( dev, DMPROGBUF6, 0x04a1fc6d );
+				// c.ebreak
+				MCF.WriteReg32( dev, DMPROGBUF7, 0x00009002 );
+			}
+			else
+			{
+				// c.sw x8,0(x9)  // First word came in via DATA0 -> x8
+				// c.lw x8,0(x11) // Second word from DATA1
+				MCF.WriteReg32( dev, DMPROGBUF0, 0x4180c080 );
+				// c.sw x8,4(x9)
+				// c.addi x9, 8
+				MCF.WriteReg32( dev, DMPROGBUF1, 0x04a1c0c0 );
+				// c.ebreak
+				MCF.WriteReg32( dev, DMPROGBUF2, 0x00009002 );
+			}
+
+			if( !StaticPROGBUFRegsValid( iss ) )
+			{
+				StaticUpdatePROGBUFRegs( dev );
 			}
 		}
-		return 0;
+
+		MCF.WriteReg32( dev, DMDATA0, address_to_write );
+		MCF.WriteReg32( dev, DMCOMMAND, 0x00231009 ); // Copy data to x9
+		memcpy( w, data, 8 );
+		MCF.WriteReg32( dev, DMDATA1, w[1] );
+		MCF.WriteReg32( dev, DMDATA0, w[0] );
+		MCF.WriteReg32( dev, DMCOMMAND, 0x00271008 ); // Copy data to x8, and execute program.
+		MCF.WriteReg32( dev, DMABSTRACTAUTO, 1 ); // Enable Autoexec.
+
+		iss->lastwriteflags = is_flash;
+		iss->statetag = STTAG( "WRS2" );
+		iss->currentstateval = address_to_write;
+		if( is_flash )
+			ret |= MCF.WaitForDoneOp( dev );
+		i = 1;
 	}
 
-	if( is_flash ) 
+	for( ; i < pairs; i++ )
 	{
-		// Need to unlock flash.
-		// Flash reg base = 0x40022000,
-		// FLASH_MODEKEYR => 0x40022024
-		// FLASH_KEYR => 0x40022004
+		// DATA1 first, writing DATA0 is what kicks off the program.
+		memcpy( w, data + i * 8, 8 );
+		MCF.WriteReg32( dev, DMDATA1, w[1] );
+		MCF.WriteReg32( dev, DMDATA0, w[0] );
+		if( is_flash )
+			ret |= MCF.WaitForDoneOp( dev );
+	}
 
-		if( !iss->flash_unlocked )
-		{
-			if( ( rw = StaticUnlockFlash( dev, iss ) ) )
-				return rw;
-		}
+	// RAM stores finish long before the next DMI write can land, so only look
+	// for errors once at the end.
+	if( !is_flash )
+		ret |= MCF.WaitForDoneOp( dev );
 
-		is_flash = 1;
+	iss->currentstateval += pairs * 8;
+	return ret;
+}
 
-		printf( "Erasing TO %08x %08x\n", address_to_write, blob_size );
-		MCF.Erase( dev, address_to_write, blob_size, 0 );
+static int InternalIsFlash( uint32_t address )
+{
+	return (address & 0xff000000) == 0x08000000 || (address & 0xff000000) == 0x00000000 || (address & 0x1FFFF800) == 0x1FFFF000;
+}
+
+// How a blob transfer gets split up: an unaligned head and tail, done a word
+// at a time, around an aligned core that goes down the fastest path the
+// programmer has (see struct MiniChlinkCapabilities).
+struct TransferPlan
+{
+	uint32_t head;   // Bytes before the aligned core.
+	uint32_t core;   // Aligned bytes, a multiple of 4 (64 for flash).
+	uint32_t tail;   // Bytes after it.
+	int use_block64; // Flash pages go through BlockWrite64 rather than word writes.
+	int use_dual;    // The core streams through DATA0/DATA1 rather than ReadWord/WriteWord.
+	int use_block_read; // Reads take the core 64 bytes at a time with BlockRead64.
+};
+
+static void InternalPlanTransfer( void * dev, uint32_t address, uint32_t len, int is_write, int is_flash, struct TransferPlan * plan )
+{
+	struct InternalState * iss = (struct InternalState*)(((struct ProgrammerStructBase*)dev)->internal);
+	struct MiniChlinkCapabilities * caps = &iss->caps;
+	uint32_t align = ( is_write && is_flash ) ? 64 : 4;
+
+	memset( plan, 0, sizeof( *plan ) );
+	plan->head = ( align - ( address & ( align - 1 ) ) ) & ( align - 1 );
+	if( plan->head > len ) plan->head = len;
+	plan->core = ( len - plan->head ) & ~( align - 1 );
+	plan->tail = len - plan->head - plan->core;
+
+	// Both ways of writing flash work on whole pages, so edges are merged into
+	// full pages too.  This only picks which way the pages go.
+	plan->use_block64 = is_write && is_flash && ( caps->flags & MCAP_BLOCK_WRITE64 ) && caps->block_write_us <= caps->page_write_us;
+
+	// Streaming two words per DMI execute replaces the default word access, to
+	// save DMI round trips.  A programmer with its own word access is left to
+	// it: its PROGBUF state would have to be thrown away.  So is one that queues
+	// DMI ops (nothing to save) or does whole blobs natively (we're only here
+	// if something bypassed those).
+	if( is_write )
+		plan->use_dual = MCF.WriteWord == DefaultWriteWord;
+	else
+		plan->use_dual = MCF.ReadWord == DefaultReadWord && !( caps->flags & MCAP_BLOCK_READ );
+	if( caps->flags & MCAP_QUEUED_DMI )
+		plan->use_dual = 0;
+
+	// A block read stands in for 8 dual reads or 16 word reads.
+	if( !is_write && ( caps->flags & MCAP_BLOCK_READ64 ) && MCF.BlockRead64 && plan->core >= 64 )
+	{
+		uint32_t other = plan->use_dual ? 16 * caps->dmi_read_us : 16 * caps->word_read_us;
+		plan->use_block_read = caps->block_read_us < other;
 	}
-	printf( "Done\n" );
-	MCF.FlushLLCommands( dev );
-	MCF.DelayUS( dev, 100 ); // Why do we need this?
+}
 
-	uint32_t wp = address_to_write;
-	uint32_t ew = wp + blob_size;
-	int group = -1;
+// Builds the 64-byte flash page at page_address out of the part of the blob that
+// lands in it.  Anything else in the page comes from background, what was there
+// before the erase, or if that's 0, reads as 0xff.
+static void InternalGetPageData( uint32_t page_address, uint32_t address_to_write, uint32_t blob_size, const uint8_t * blob, const uint8_t * background, uint8_t * pagedata )
+{
+	int i;
+	for( i = 0; i < 64; i++ )
+	{
+		uint32_t a = page_address + i;
+		if( a >= address_to_write && a - address_to_write < blob_size )
+			pagedata[i] = blob[a - address_to_write];
+		else
+			pagedata[i] = background ? background[i] : 0xff;
+	}
+}
 
-	while( wp < ew )
+// Writes less than a word with half-word and byte stores, so the rest of the
+// word is never touched.
+static int InternalWritePartialWord( void * dev, uint32_t address, uint32_t len, const uint8_t * data )
+{
+	int r = 0;
+	while( len )
 	{
-		if( is_flash )
+		if( ( address & 1 ) == 0 && len >= 2 )
 		{
-			group = (wp & 0xffffffc0);
-			MCF.WriteWord( dev, 0x40022010, CR_PAGE_PG ); // THIS IS REQUIRED, (intptr_t)&FLASH->CTLR = 0x40022010
-			MCF.WriteWord( dev, 0x40022010, CR_BUF_RST | CR_PAGE_PG );  // (intptr_t)&FLASH->CTLR = 0x40022010
-
-			int j;
-			for( j = 0; j < 16; j++ )
-			{
-				int index = (wp-address_to_write);
-				uint32_t data = 0xffffffff;
-				if( index + 3 < blob_size )
-					data = ((uint32_t*)blob)[index/4];
-				else if( (int32_t)(blob_size - index) > 0 )
-				{
-					printf( "%d %d\n", blob_size, index );
-					memcpy( &data, &blob[index], blob_size - index );
-				}
-				MCF.WriteWord( dev, wp, data );
-				wp += 4;
-			}
-			MCF.WriteWord( dev, 0x40022014, group );  //0x40022014 -> FLASH->ADDR
-			MCF.WriteWord( dev, 0x40022010, CR_PAGE_PG|CR_STRT_Set ); // 0x40022010 -> FLASH->CTLR
-			if( MCF.WaitForFlash ) MCF.WaitForFlash( dev );
+			r |= MCF.WriteHalfWord( dev, address, data[0] | ( data[1] << 8 ) );
+			address += 2, data += 2, len -= 2;
 		}
 		else
 		{
-			int index = (wp-address_to_write);
-			uint32_t data = 0xffffffff;
-			if( index + 3 < blob_size )
-				data = ((uint32_t*)blob)[index/4];
-			else if( (int32_t)(blob_size - index) > 0 )
-				memcpy( &data, &blob[index], blob_size - index );
-			MCF.WriteWord( dev, wp, data );
-			wp += 4;
+			r |= MCF.WriteByte( dev, address, data[0] );
+			address++, data++, len--;
 		}
 	}
+	return r;
+}
 
-	if( is_flash )
+// Loads one page into the flash buffer and starts programming it.  Does not wait
+// for the flash to finish, so the caller can get something else done meanwhile.
+static int InternalStartPageWrite( void * dev, uint32_t page_address, const uint8_t * pagedata )
+{
+	int r = 0;
+	int j;
+	r |= MCF.WriteWord( dev, 0x40022010, CR_PAGE_PG ); // THIS IS REQUIRED, (intptr_t)&FLASH->CTLR = 0x40022010
+	r |= MCF.WriteWord( dev, 0x40022010, CR_BUF_RST | CR_PAGE_PG );  // (intptr_t)&FLASH->CTLR = 0x40022010
+	if( MCF.WriteWord == DefaultWriteWord )
 	{
-		if( MCF.WaitForFlash && MCF.WaitForFlash( dev ) ) goto timedout;
+		r |= InternalWriteWordsDual( dev, page_address, 8, pagedata );
 	}
-	return 0;
-timedout:
-	fprintf( stderr, "Timed out\n" );
-	return -5;
+	else
+	{
+		for( j = 0; j < 16; j++ )
+		{
+			uint32_t data;
+			memcpy( &data, pagedata + j * 4, 4 );
+			r |= MCF.WriteWord( dev, page_address + j * 4, data );
+		}
+	}
+	r |= MCF.WriteWord( dev, 0x40022014, page_address );  //0x40022014 -> FLASH->ADDR
+	r |= MCF.WriteWord( dev, 0x40022010, CR_PAGE_PG|CR_STRT_Set ); // 0x40022010 -> FLASH->CTLR
+	return r;
 }
 
-static int DefaultReadWord( void * dev, uint32_t address_to_read, uint32_t * data )
+#define MAIN_FLASH_SIZE    16384
+#define MAIN_FLASH_PAGES   ( MAIN_FLASH_SIZE / 64 )
+
+static int InternalEraseDirtyPages( void * dev, uint32_t flash_base, const uint8_t * dirty );
+
+// Returns 0 if the page matches, 1 if it doesn't, negative on fault.
+static int InternalVerifyPage( void * dev, uint32_t page_address, const uint8_t * pagedata )
 {
-	struct InternalState * iss = (struct InternalState*)(((struct ProgrammerStructBase*)dev)->internal);
-	if( iss->statetag != STTAG( "RDSQ" ) || address_to_read != iss->currentstateval )
+	uint8_t readback[64];
+	int r = MCF.ReadBinaryBlob( dev, page_address, 64, readback );
+	if( r ) return r;
+	return memcmp( readback, pagedata, 64 ) ? 1 : 0;
+}
+
+// Erases and rewrites a page that failed verification, a few times if need be.
+static int InternalRewritePage( void * dev, uint32_t page_address, const uint8_t * pagedata, int use_block64 )
+{
+	int tries;
+	for( tries = 0; tries < 3; tries++ )
+	{
+		fprintf( stderr, "Verify failed at %08x, rewriting page\n", page_address );
+		if( MCF.Erase( dev, page_address, 64, 0 ) ) continue;
+		int r;
+		if( use_block64 )
+			r = MCF.BlockWrite64( dev, page_address, (uint8_t*)pagedata );
+		else
+		{
+			r = InternalStartPageWrite( dev, page_address, pagedata );
+			if( MCF.WaitForFlash ) r |= MCF.WaitForFlash( dev );
+		}
+		if( r ) continue;
+		r = InternalVerifyPage( dev, page_address, pagedata );
+		if( r < 0 ) return r;
+		if( r == 0 ) return 0;
+	}
+	fprintf( stderr, "Error: page at %08x will not verify\n", page_address );
+	return -14;
+}
+
+// Gets what's in a partly-written edge page before the write touches it.  The
+// first attempt at a write keeps a copy; a resumed one (see write_resuming) uses
+// that copy, since by then the page may already be erased.
+static int InternalEdgeBackground( void * dev, uint32_t page, uint8_t * bg )
+{
+	struct InternalState * iss = (struct InternalState*)(((struct ProgrammerStructBase*)dev)->internal);
+	int i, r;
+	if( iss->write_resuming )
+	{
+		for( i = 0; i < 2; i++ )
+			if( iss->write_bg_page[i] == page )
+			{
+				memcpy( bg, iss->write_bg[i], 64 );
+				return 0;
+			}
+	}
+	if( ( r = MCF.ReadBinaryBlob( dev, page, 64, bg ) ) ) return r;
+	if( !iss->write_resuming )
+	{
+		i = ( iss->write_bg_page[0] == 1 ) ? 0 : 1;
+		iss->write_bg_page[i] = page;
+		memcpy( iss->write_bg[i], bg, 64 );
+	}
+	return 0;
+}
+
+// Verifies a page that's done programming, rewriting it if need be, then moves
+// the write checkpoint past it.
+static int InternalConfirmPage( void * dev, uint32_t page_address, const uint8_t * pagedata, int use_block64 )
+{
+	struct InternalState * iss = (struct InternalState*)(((struct ProgrammerStructBase*)dev)->internal);
+	int r = InternalVerifyPage( dev, page_address, pagedata );
+	if( r < 0 ) return r;
+	if( r && ( r = InternalRewritePage( dev, page_address, pagedata, use_block64 ) ) ) return r;
+	iss->write_checkpoint = page_address + 64;
+	return 0;
+}
+
+int DefaultWriteBinaryBlob( void * dev, uint32_t address_to_write, uint32_t blob_size, uint8_t * blob )
+{
+	// NOTE IF YOU FIX SOMETHING IN THIS FUNCTION PLEASE ALSO UPDATE THE PROGRAMMERS.
+	//  this is only fallback functionality for really realy basic programmers.
+
+	uint32_t rw;
+	struct InternalState * iss = (struct InternalState*)(((struct ProgrammerStructBase*)dev)->internal);
+	int is_flash = 0;
+
+	if( blob_size == 0 ) return 0;
+
+	// Nothing in this write is known good yet.  As pages are confirmed, this
+	// moves up, so if the link drops, a retry can pick up from here.
+	iss->write_checkpoint = address_to_write;
+
+	is_flash = InternalIsFlash( address_to_write );
+
+	struct TransferPlan plan;
+	InternalPlanTransfer( dev, address_to_write, blob_size, 1, is_flash, &plan );
+	int use_block64 = plan.use_block64;
+
+	// Pages only partly covered by the blob keep the rest of what was in them,
+	// so read them before anything gets erased.
+	if( !iss->write_resuming )
+		iss->write_bg_page[0] = iss->write_bg_page[1] = 1;
+	uint8_t firstbg[64];
+	uint8_t lastbg[64];
+	uint32_t first_page = address_to_write & 0xffffffc0;
+	uint32_t last_page = ( address_to_write + blob_size - 1 ) & 0xffffffc0;
+	int first_partial = is_flash && ( address_to_write > first_page || address_to_write + blob_size < first_page + 64 );
+	int last_partial = is_flash && last_page != first_page && address_to_write + blob_size < last_page + 64;
+	if( first_partial && ( rw = InternalEdgeBackground( dev, first_page, firstbg ) ) ) return rw;
+	if( last_partial && ( rw = InternalEdgeBackground( dev, last_page, lastbg ) ) ) return rw;
+
+	// Which pages of main flash this write has to erase and program.  An edge
+	// page that already holds what it would be rewritten with is left alone.
+	uint8_t dirty[MAIN_FLASH_PAGES] = { 0 };
+	uint32_t flash_base = address_to_write & 0xff000000;
+	int in_main = is_flash && ( flash_base == 0x08000000 || flash_base == 0x00000000 ) &&
+		address_to_write - flash_base + blob_size <= MAIN_FLASH_SIZE;
+	if( in_main )
+	{
+		uint8_t merged[64];
+		uint32_t page;
+		for( page = first_page; page <= last_page; page += 64 )
+			dirty[( page - flash_base ) / 64] = 1;
+		if( first_partial )
+		{
+			InternalGetPageData( first_page, address_to_write, blob_size, blob, firstbg, merged );
+			if( !memcmp( merged, firstbg, 64 ) ) dirty[( first_page - flash_base ) / 64] = 0;
+		}
+		if( last_partial )
+		{
+			InternalGetPageData( last_page, address_to_write, blob_size, blob, lastbg, merged );
+			if( !memcmp( merged, lastbg, 64 ) ) dirty[( last_page - flash_base ) / 64] = 0;
+		}
+	}
+
+	if( is_flash && !use_block64 )
+	{
+		// Need to unlock flash.
+		// Flash reg base = 0x40022000,
+		// FLASH_MODEKEYR => 0x40022024
+		// FLASH_KEYR => 0x40022004
+
+		if( !iss->flash_unlocked )
+		{
+			if( ( rw = StaticUnlockFlash( dev, iss ) ) )
+				return rw;
+		}
+
+		printf( "Erasing TO %08x %08x\n", address_to_write, blob_size );
+		if( in_main && MCF.Erase == DefaultErase )
+			rw = InternalEraseDirtyPages( dev, flash_base, dirty );
+		else
+		{
+			// This wipes clean pages too, so they all have to be programmed.
+			rw = MCF.Erase( dev, address_to_write, blob_size, 0 );
+			memset( dirty, 1, sizeof( dirty ) );
+		}
+		if( rw ) return rw;
+		printf( "Done\n" );
+		MCF.FlushLLCommands( dev );
+	}
+
+	if( is_flash )
+	{
+		// With -v, each page is read back while the next one programs.  Flash
+		// reads stall until the program is done, so the readback's link round
+		// trips overlap the program time instead of following it.  The page
+		// being read is never the one programming, and one that needs rewriting
+		// waits for the program to finish first.
+		uint32_t ew = address_to_write + blob_size;
+		uint32_t page_address;
+		uint8_t pagedata[64];
+		uint8_t prevdata[64];
+		uint32_t prev_page = 0;
+		int prev_pending = 0;
+		int r;
+
+		for( page_address = address_to_write & 0xffffffc0; page_address < ew; page_address += 64 )
+		{
+			if( in_main && !dirty[( page_address - flash_base ) / 64] )
+			{
+				if( prev_pending && ( r = InternalConfirmPage( dev, prev_page, prevdata, use_block64 ) ) ) return r;
+				prev_pending = 0;
+				iss->write_checkpoint = page_address + 64;
+				continue;
+			}
+			const uint8_t * background = 0;
+			if( page_address == first_page && first_partial ) background = firstbg;
+			else if( page_address == last_page && last_partial ) background = lastbg;
+			InternalGetPageData( page_address, address_to_write, blob_size, blob, background, pagedata );
+
+			if( use_block64 )
+				r = MCF.BlockWrite64( dev, page_address, pagedata );
+			else
+				r = InternalStartPageWrite( dev, page_address, pagedata );
+			if( r )
+			{
+				fprintf( stderr, "Error writing block at memory %08x\n", page_address );
+				return r;
+			}
+
+			if( prev_pending )
+			{
+				r = InternalVerifyPage( dev, prev_page, prevdata );
+				if( r < 0 ) return r;
+				if( !use_block64 && MCF.WaitForFlash && MCF.WaitForFlash( dev ) ) goto timedout;
+				if( r && ( r = InternalRewritePage( dev, prev_page, prevdata, use_block64 ) ) ) return r;
+				iss->write_checkpoint = prev_page + 64;
+			}
+			else if( !use_block64 && MCF.WaitForFlash && MCF.WaitForFlash( dev ) ) goto timedout;
+
+			if( iss->verify_writes )
+			{
+				memcpy( prevdata, pagedata, 64 );
+				prev_page = page_address;
+				prev_pending = 1;
+			}
+			else
+				iss->write_checkpoint = page_address + 64;
+		}
+		if( prev_pending && ( r = InternalConfirmPage( dev, prev_page, prevdata, use_block64 ) ) ) return r;
+		return 0;
+	}
+
+	// RAM and registers: whole words through the core, the edges merged into
+	// the words around them.
+	int r = 0;
+	uint32_t wp = address_to_write + plan.head;
+	const uint8_t * bp = blob + plan.head;
+	if( plan.head )
+		r |= InternalWritePartialWord( dev, address_to_write, plan.head, blob );
+	if( plan.use_dual && plan.core >= 8 )
+	{
+		r |= InternalWriteWordsDual( dev, wp, plan.core / 8, bp );
+		wp += plan.core & ~7;
+		bp += plan.core & ~7;
+	}
+	while( wp < address_to_write + plan.head + plan.core )
+	{
+		uint32_t data;
+		memcpy( &data, bp, 4 );
+		r |= MCF.WriteWord( dev, wp, data );
+		wp += 4;
+		bp += 4;
+	}
+	if( plan.tail )
+		r |= InternalWritePartialWord( dev, wp, plan.tail, bp );
+	if( r ) return r;
+
+	if( iss->verify_writes )
+	{
+		uint8_t * readback = malloc( blob_size + 4 );
+		r = MCF.ReadBinaryBlob( dev, address_to_write, blob_size, readback );
+		if( !r && memcmp( readback, blob, blob_size ) )
+		{
+			fprintf( stderr, "Error: verify failed writing to %08x\n", address_to_write );
+			r = -14;
+		}
+		free( readback );
+		return r;
+	}
+	return 0;
+timedout:
+	fprintf( stderr, "Timed out\n" );
+	return -5;
+}
+
+static int DefaultReadWord( void * dev, uint32_t address_to_read, uint32_t * data )
+{
+	struct InternalState * iss = (struct InternalState*)(((struct ProgrammerStructBase*)dev)->internal);
+	if( iss->statetag != STTAG( "RDSQ" ) || address_to_read != iss->currentstateval )
 	{
 		if( iss->statetag != STTAG( "RDSQ" ) )
 		{
@@ -847,7 +1522,7 @@ static int DefaultReadWord( void * dev, uint32_t address_to_read, uint32_t * dat
 			// c.ebreak
 			MCF.WriteReg32( dev, DMPROGBUF2, 0x9002c180 );
 
-			if( iss->statetag != STTAG( "WRSQ" ) )
+			if( !StaticPROGBUFRegsValid( iss ) )
 			{
 				StaticUpdatePROGBUFRegs( dev );
 			}
@@ -868,6 +1543,62 @@ static int DefaultReadWord( void * dev, uint32_t address_to_read, uint32_t * dat
 	return MCF.ReadReg32( dev, DMDATA0, data );
 }
 
+// Sequential reads, 8 bytes per execute.  Like the write side, the pointer is
+// kept in x9 so both DATA0 and DATA1 can carry data back.  Only for programmers
+// using DefaultReadWord.
+static int InternalReadWordsDual( void * dev, uint32_t address_to_read, int pairs, uint8_t * data )
+{
+	struct InternalState * iss = (struct InternalState*)(((struct ProgrammerStructBase*)dev)->internal);
+	uint32_t w[2];
+	int r = 0;
+	int i;
+
+	if( iss->statetag != STTAG( "RDS2" ) || address_to_read != iss->currentstateval )
+	{
+		if( iss->statetag != STTAG( "RDS2" ) && MCF.VoidHighLevelState ) MCF.VoidHighLevelState( dev );
+		MCF.WriteReg32( dev, DMABSTRACTAUTO, 0 ); // Disable Autoexec.
+		if( iss->statetag != STTAG( "RDS2" ) )
+		{
+			// c.lw x8,0(x9)  // Read the first word
+			// c.sw x8,0(x10) // Into DATA0
+			MCF.WriteReg32( dev, DMPROGBUF0, 0xc1004080 );
+			// c.lw x8,4(x9)  // Read the second word
+			// c.sw x8,0(x11) // Into DATA1
+			MCF.WriteReg32( dev, DMPROGBUF1, 0xc18040c0 );
+			// c.addi x9, 8
+			// c.ebreak
+			MCF.WriteReg32( dev, DMPROGBUF2, 0x900204a1 );
+
+			if( !StaticPROGBUFRegsValid( iss ) )
+			{
+				StaticUpdatePROGBUFRegs( dev );
+			}
+		}
+
+		MCF.WriteReg32( dev, DMDATA0, address_to_read );
+		MCF.WriteReg32( dev, DMCOMMAND, 0x00231009 ); // Copy data to x9
+		MCF.WriteReg32( dev, DMCOMMAND, 0x00241000 ); // Only execute.
+		MCF.WriteReg32( dev, DMABSTRACTAUTO, 1 ); // Enable Autoexec.
+
+		iss->statetag = STTAG( "RDS2" );
+		iss->currentstateval = address_to_read;
+
+		r = MCF.WaitForDoneOp( dev );
+		if( r ) return r;
+	}
+
+	for( i = 0; i < pairs; i++ )
+	{
+		// DATA1 first, reading DATA0 is what kicks off the next pair.
+		r |= MCF.ReadReg32( dev, DMDATA1, &w[1] );
+		r |= MCF.ReadReg32( dev, DMDATA0, &w[0] );
+		memcpy( data + i * 8, w, 8 );
+	}
+
+	iss->currentstateval += pairs * 8;
+	return r;
+}
+
 static int StaticUnlockFlash( void * dev, struct InternalState * iss )
 {
 	uint32_t rw;
@@ -893,6 +1624,87 @@ static int StaticUnlockFlash( void * dev, struct InternalState * iss )
 	return 0;
 }
 
+static int InternalEraseOp( void * dev, int op, uint32_t address )
+{
+	static const uint32_t ctlr_bits[3] = { CR_PAGE_ER, CR_PER_Set, FLASH_CTLR_MER };
+
+	MCF.WriteWord( dev, (intptr_t)&FLASH->CTLR, ctlr_bits[op] );
+	if( op != ERASE_OP_MASS )
+		MCF.WriteWord( dev, (intptr_t)&FLASH->ADDR, address );
+	MCF.WriteWord( dev, (intptr_t)&FLASH->CTLR, CR_STRT_Set|ctlr_bits[op] );
+	if( MCF.WaitForFlash && MCF.WaitForFlash( dev ) ) return -99;
+	return 0;
+}
+
+// What each ERASE_OP_* costs: a rough figure for the flash itself, plus the
+// register accesses it takes (the writes and at least one busy poll) at
+// whatever one access was measured to cost on this link.  Measured once.
+static void InternalEraseCosts( void * dev, uint32_t * cost )
+{
+	static const uint32_t flash_us[3] = { 2500, 3500, 6000 };
+	static const uint32_t accesses[3] = { 4, 4, 4 };
+	struct InternalState * iss = (struct InternalState*)(((struct ProgrammerStructBase*)dev)->internal);
+	int op;
+
+	if( !iss->erase_access_us )
+	{
+		uint32_t rw;
+		uint64_t start = InternalTimeUS();
+		for( op = 0; op < 4; op++ )
+			MCF.ReadWord( dev, (intptr_t)&FLASH->STATR, &rw );
+		iss->erase_access_us = (uint32_t)( InternalTimeUS() - start ) / 4 + 1;
+	}
+	for( op = 0; op < 3; op++ )
+		cost[op] = flash_us[op] + accesses[op] * iss->erase_access_us;
+}
+
+// Erases every page flagged in dirty[] (one entry per 64-byte page of main
+// flash), picking whichever mix of mass, sector and page erases is cheapest.
+// Sector and mass erases are only used where every page they hit is dirty.
+static int InternalEraseDirtyPages( void * dev, uint32_t flash_base, const uint8_t * dirty )
+{
+	uint32_t cost[3];
+	uint8_t use_sector[MAIN_FLASH_PAGES/16];
+	uint32_t planned = 0;
+	int all_dirty = 1;
+	int s, p, r;
+
+	InternalEraseCosts( dev, cost );
+
+	for( s = 0; s < MAIN_FLASH_PAGES/16; s++ )
+	{
+		int n = 0;
+		for( p = 0; p < 16; p++ )
+			n += !!dirty[s*16+p];
+		use_sector[s] = ( n == 16 && cost[ERASE_OP_SECTOR] < 16 * cost[ERASE_OP_PAGE] );
+		planned += use_sector[s] ? cost[ERASE_OP_SECTOR] : n * cost[ERASE_OP_PAGE];
+		if( n != 16 ) all_dirty = 0;
+	}
+
+	if( all_dirty && cost[ERASE_OP_MASS] < planned )
+	{
+		r = InternalEraseOp( dev, ERASE_OP_MASS, flash_base );
+		MCF.WriteWord( dev, (intptr_t)&FLASH->CTLR, 0 );
+		return r;
+	}
+
+	for( s = 0; s < MAIN_FLASH_PAGES/16; s++ )
+	{
+		uint32_t sector_address = flash_base + s * 1024;
+		if( use_sector[s] )
+		{
+			if( ( r = InternalEraseOp( dev, ERASE_OP_SECTOR, sector_address ) ) ) return r;
+			continue;
+		}
+		for( p = 0; p < 16; p++ )
+		{
+			if( !dirty[s*16+p] ) continue;
+			if( ( r = InternalEraseOp( dev, ERASE_OP_PAGE, sector_address + p * 64 ) ) ) return r;
+		}
+	}
+	return 0;
+}
+
 int DefaultErase( void * dev, uint32_t address, uint32_t length, int type )
 {
 	struct InternalState * iss = (struct InternalState*)(((struct ProgrammerStructBase*)dev)->internal);
@@ -910,9 +1722,7 @@ int DefaultErase( void * dev, uint32_t address, uint32_t length, int type )
 		iss->statetag = STTAG( "XXXX" );
 		printf( "Whole-chip erase\n" );
 		MCF.WriteWord( dev, (intptr_t)&FLASH->CTLR, 0 );
-		MCF.WriteWord( dev, (intptr_t)&FLASH->CTLR, FLASH_CTLR_MER  );
-		MCF.WriteWord( dev, (intptr_t)&FLASH->CTLR, CR_STRT_Set|FLASH_CTLR_MER );
-		if( MCF.WaitForFlash && MCF.WaitForFlash( dev ) ) return -11;		
+		if( InternalEraseOp( dev, ERASE_OP_MASS, 0 ) ) return -11;
 		MCF.WriteWord( dev, (intptr_t)&FLASH->CTLR, 0 );
 	}
 	else
@@ -920,19 +1730,22 @@ int DefaultErase( void * dev, uint32_t address, uint32_t length, int type )
 		// 16.4.7, Step 3: Check the BSY bit of the FLASH_STATR register to confirm that there are no other programming operations in progress.
 		// skip (we make sure at the end)
 
-		int chunk_to_erase = address;
+		uint32_t flash_base = address & 0xff000000;
+		if( ( flash_base == 0x08000000 || flash_base == 0x00000000 ) && address - flash_base + length <= MAIN_FLASH_SIZE )
+		{
+			// Main flash, let the planner decide how to erase it.
+			uint8_t dirty[MAIN_FLASH_PAGES] = { 0 };
+			uint32_t page;
+			for( page = ( address - flash_base ) / 64; page * 64 < address - flash_base + length; page++ )
+				dirty[page] = 1;
+			return InternalEraseDirtyPages( dev, flash_base, dirty );
+		}
 
+		// Anywhere else (i.e. the bootloader) only gets fast page erases.
+		uint32_t chunk_to_erase = address & 0xffffffc0;
 		while( chunk_to_erase < address + length )
 		{
-			// Step 4:  set PAGE_ER of FLASH_CTLR(0x40022010)
-			MCF.WriteWord( dev, (intptr_t)&FLASH->CTLR, CR_PAGE_ER ); // Actually FTER
-
-			// Step 5: Write the first address of the fast erase page to the FLASH_ADDR register.
-			MCF.WriteWord( dev, (intptr_t)&FLASH->ADDR, chunk_to_erase  );
-
-			// Step 6: Set the STAT bit of FLASH_CTLR register to '1' to initiate a fast page erase (64 bytes) action.
-			MCF.WriteWord( dev, (intptr_t)&FLASH->CTLR, CR_STRT_Set|CR_PAGE_ER );
-			if( MCF.WaitForFlash && MCF.WaitForFlash( dev ) ) return -99;
+			if( InternalEraseOp( dev, ERASE_OP_PAGE, chunk_to_erase ) ) return -99;
 			chunk_to_erase+=64;
 		}
 	}
@@ -941,19 +1754,44 @@ int DefaultErase( void * dev, uint32_t address, uint32_t length, int type )
 
 int DefaultReadBinaryBlob( void * dev, uint32_t address_to_read_from, uint32_t read_size, uint8_t * blob )
 {
+	struct TransferPlan plan;
 	uint32_t rpos = address_to_read_from;
-	uint32_t rend = address_to_read_from + read_size;
-	while( rpos < rend )
+	uint32_t rw;
+	int r;
+
+	InternalPlanTransfer( dev, address_to_read_from, read_size, 0, 0, &plan );
+	if( plan.head )
 	{
-		uint32_t rw;
-		int r = DefaultReadWord( dev, rpos, &rw );
-		if( r ) return r;
-		int remain = rend - rpos;
-		if( remain > 3 ) remain = 4;
-		memcpy( blob, &rw, remain );
+		if( ( r = MCF.ReadWord( dev, rpos & ~3, &rw ) ) ) return r;
+		memcpy( blob, ((uint8_t*)&rw) + ( rpos & 3 ), plan.head );
+		blob += plan.head;
+		rpos += plan.head;
+	}
+	if( plan.use_block_read )
+	{
+		if( ( r = MCF.BlockRead64( dev, rpos, blob, plan.core / 64 ) ) ) return r;
+		blob += plan.core & ~63;
+		rpos += plan.core & ~63;
+	}
+	uint32_t core_left = address_to_read_from + plan.head + plan.core - rpos;
+	if( plan.use_dual && core_left >= 8 )
+	{
+		if( ( r = InternalReadWordsDual( dev, rpos, core_left / 8, blob ) ) ) return r;
+		blob += core_left & ~7;
+		rpos += core_left & ~7;
+	}
+	while( rpos < address_to_read_from + plan.head + plan.core )
+	{
+		if( ( r = MCF.ReadWord( dev, rpos, &rw ) ) ) return r;
+		memcpy( blob, &rw, 4 );
 		blob += 4;
 		rpos += 4;
 	}
+	if( plan.tail )
+	{
+		if( ( r = MCF.ReadWord( dev, rpos, &rw ) ) ) return r;
+		memcpy( blob, &rw, plan.tail );
+	}
 	return 0;
 }
 
@@ -1264,6 +2102,19 @@ fail:
 
 int SetupAutomaticHighLevelFunctions( void * dev )
 {
+	struct InternalState * iss = (struct InternalState*)(((struct ProgrammerStructBase*)dev)->internal);
+
+	// Programmers that don't say what they can do get guessed at, from what
+	// functions they provide, and costs for a plain DMI link.
+	if( MCF.BlockWrite64 ) iss->caps.flags |= MCAP_BLOCK_WRITE64;
+	if( !iss->caps.dmi_read_us ) iss->caps.dmi_read_us = 100;
+	if( !iss->caps.word_read_us ) iss->caps.word_read_us = iss->caps.dmi_read_us;
+	if( MCF.BlockRead64 ) iss->caps.flags |= MCAP_BLOCK_READ64;
+	if( MCF.ReadBinaryBlob && MCF.ReadBinaryBlob != DefaultReadBinaryBlob ) iss->caps.flags |= MCAP_BLOCK_READ;
+	if( !iss->caps.block_write_us ) iss->caps.block_write_us = 3000;
+	if( !iss->caps.block_read_us ) iss->caps.block_read_us = 8 * iss->caps.dmi_read_us;
+	if( !iss->caps.page_write_us ) iss->caps.page_write_us = 3000 + 20 * iss->caps.dmi_read_us;
+
 	// Will populate high-level functions from low-level functions.
 	if( MCF.WriteReg32 == 0 || MCF.ReadReg32 == 0 ) return -5;
 
@@ -1284,6 +2135,10 @@ int SetupAutomaticHighLevelFunctions( void * dev )
 		MCF.ReadWord = DefaultReadWord;
 	if( !MCF.ReadHalfWord )
 		MCF.ReadHalfWord = DefaultReadHalfWord;
+	if( !MCF.WriteByte )
+		MCF.WriteByte = DefaultWriteByte;
+	if( !MCF.ReadByte )
+		MCF.ReadByte = DefaultReadByte;
 	if( !MCF.Erase )
 		MCF.Erase = DefaultErase;
 	if( !MCF.HaltMode )
@@ -1301,16 +2156,1393 @@ int SetupAutomaticHighLevelFunctions( void * dev )
 	if( !MCF.ConfigureNRSTAsGPIO )
 		MCF.ConfigureNRSTAsGPIO = DefaultConfigureNRSTAsGPIO;
 
-	struct InternalState * iss = malloc( sizeof( struct InternalState ) );
-	iss->statetag = 0;
-	iss->currentstateval = 0;
-
-	((struct ProgrammerStructBase*)dev)->internal = iss;
 	return 0;
 }
 
+void * MiniChlinkOpen( const char * selector )
+{
+	// All programmers get internal state, even if they do everything themselves.
+	struct InternalState * iss = calloc( 1, sizeof( struct InternalState ) );
+	void * dev = 0;
+	const char * colon = selector ? strchr( selector, ':' ) : 0;
+	int kindlen = colon ? (int)( colon - selector ) : selector ? (int)strlen( selector ) : 0;
+	int index = colon ? (int)SimpleReadNumberInt( colon + 1, -1 ) : 0;
+	int any = kindlen == 0;
+	// Whole names only, so "link" or "esp" don't quietly pick something.
+	int linke = kindlen == 5 && strncmp( selector, "linke", 5 ) == 0;
+	int esp32s2 = kindlen == 7 && strncmp( selector, "esp32s2", 7 ) == 0;
+
+	if( index < 0 || !( any || linke || esp32s2 ) )
+	{
+		fprintf( stderr, "Error: Bad programmer selector \"%s\", want linke[:n] or esp32s2[:n]\n", selector );
+		free( iss );
+		return 0;
+	}
+
+	if( ( any || linke ) && (dev = TryInit_WCHLinkE( iss, index )) )
+	{
+		fprintf( stderr, "Found WCH LinkE\n" );
+	}
+	else if( ( any || esp32s2 ) && (dev = TryInit_ESP32S2CHFUN( iss, index )) )
+	{
+		fprintf( stderr, "Found ESP32S2 Programmer\n" );
+	}
+	else
+	{
+		fprintf( stderr, "Error: Could not initialize any supported programmers\n" );
+		free( iss );
+		return 0;
+	}
+
+	iss->lock = InternalLockCreate();
+	SetupAutomaticHighLevelFunctions( dev );
+	MCF.api_version = MINICHLINK_API_VERSION;
+	MCF.struct_size = sizeof( struct MiniChlinkFunctions );
+	return dev;
+}
+
+void MiniChlinkClose( void * dev )
+{
+	struct InternalState * iss = (struct InternalState*)(((struct ProgrammerStructBase*)dev)->internal);
+	int i;
+	InternalLockTake( iss->lock );
+	if( MCF.FlushLLCommands )
+		MCF.FlushLLCommands( dev );
+	if( MCF.Exit )
+		MCF.Exit( dev );
+	InternalLockRelease( iss->lock );
+	InternalLockDestroy( iss->lock );
+	for( i = 3; i < SEMIHOST_MAX_FILES; i++ )
+		if( iss->semihost_files[i] ) fclose( iss->semihost_files[i] );
+	free( iss );
+}
+
+struct MiniChlinkFunctions * MiniChlinkGetFunctions( void * dev )
+{
+	return &MCF;
+}
+
+void MiniChlinkLock( void * dev )
+{
+	InternalLockTake( ((struct ProgrammerStructBase*)dev)->internal->lock );
+}
+
+void MiniChlinkUnlock( void * dev )
+{
+	InternalLockRelease( ((struct ProgrammerStructBase*)dev)->internal->lock );
+}
+
+// Wraps a call through the function table with the lock, and a flush after.
+#define LOCKED_CALL( fn, ... ) \
+	int r = -1; \
+	MiniChlinkLock( dev ); \
+	if( MCF.fn ) \
+	{ \
+		r = MCF.fn( dev, __VA_ARGS__ ); \
+		if( MCF.FlushLLCommands ) MCF.FlushLLCommands( dev ); \
+	} \
+	MiniChlinkUnlock( dev ); \
+	return r;
+
+int MiniChlinkSetupInterface( void * dev )
+{
+	int r = -1;
+	MiniChlinkLock( dev );
+	if( MCF.SetupInterface )
+		r = MCF.SetupInterface( dev );
+	MiniChlinkUnlock( dev );
+	return r;
+}
+
+int MiniChlinkHaltMode( void * dev, int mode ) { LOCKED_CALL( HaltMode, mode ); }
+int MiniChlinkErase( void * dev, uint32_t address, uint32_t length, int type ) { LOCKED_CALL( Erase, address, length, type ); }
+int MiniChlinkWriteBinaryBlob( void * dev, uint32_t address_to_write, uint32_t blob_size, uint8_t * blob ) { LOCKED_CALL( WriteBinaryBlob, address_to_write, blob_size, blob ); }
+int MiniChlinkReadBinaryBlob( void * dev, uint32_t address_to_read_from, uint32_t read_size, uint8_t * blob ) { LOCKED_CALL( ReadBinaryBlob, address_to_read_from, read_size, blob ); }
 
 
+#ifndef MINICHLINK_AS_LIBRARY
+// Writes a blob, and if the link falls over partway through, re-attaches and
+// carries on from the first page the writer couldn't confirm.  Writers that
+// don't keep a checkpoint just start over.
+static int InternalWriteWithResume( void * dev, uint32_t address, uint32_t len, uint8_t * image )
+{
+	struct InternalState * iss = (struct InternalState*)(((struct ProgrammerStructBase*)dev)->internal);
+	uint32_t start = address;
+	uint32_t end = address + len;
+	int tries;
+	int r = -1;
+
+	iss->write_resuming = 0;
+	for( tries = 0; tries < 4; tries++ )
+	{
+		iss->write_checkpoint = start;
+		r = MCF.WriteBinaryBlob( dev, start, end - start, image + ( start - address ) );
+		if( r == 0 )
+			break;
+		// Whatever's left of the edge pages may be erased by now.
+		iss->write_resuming = 1;
+
+		uint32_t resume = iss->write_checkpoint;
+		if( resume < start ) resume = start;
+		if( resume > end ) resume = end;
+		start = resume;
+		fprintf( stderr, "Write failed (%d) with %d of %d bytes confirmed.  Re-attaching to resume at %08x.\n", r, start - address, len, start );
+
+		// We don't know what state anything was left in.
+		iss->statetag = STTAG( "XXXX" );
+		iss->flash_unlocked = 0;
+		if( MCF.VoidHighLevelState ) MCF.VoidHighLevelState( dev );
+		if( MCF.SetupInterface && MCF.SetupInterface( dev ) < 0 )
+			continue;
+		if( MCF.HaltMode ) MCF.HaltMode( dev, 0 );
+	}
+	iss->write_resuming = 0;
+	return r;
+}
+
+// PROGBUF programs (i.e. DefaultReadWord) clobber x8-x13 and the DATA registers,
+// so if the hart is going to carry on afterwards, put them back the way we found
+// them.  regs must hold 10 words.  The hart must already be halted.
+static int InternalSaveHartState( void * dev, uint32_t * regs )
+{
+	int i;
+	int r = 0;
+	uint32_t dmstatus = 0;
+	for( i = 0; i < 100; i++ )
+	{
+		r = MCF.ReadReg32( dev, DMSTATUS, &dmstatus );
+		if( r ) return r;
+		if( dmstatus & (1<<9) ) break; // allhalted
+	}
+	if( i == 100 )
+	{
+		fprintf( stderr, "Error: hart did not halt (DMSTATUS = %08x)\n", dmstatus );
+		return -9;
+	}
+
+	MCF.WriteReg32( dev, DMABSTRACTAUTO, 0 ); // Disable Autoexec.
+	r |= MCF.ReadReg32( dev, DMDATA0, &regs[8] );
+	r |= MCF.ReadReg32( dev, DMDATA1, &regs[9] );
+	for( i = 0; i < 8; i++ )
+	{
+		MCF.WriteReg32( dev, DMCOMMAND, 0x00221008 + i ); // Read x8+i into DATA0.
+		r |= MCF.WaitForDoneOp( dev );
+		r |= MCF.ReadReg32( dev, DMDATA0, &regs[i] );
+	}
+	return r;
+}
+
+static int InternalRestoreHartState( void * dev, const uint32_t * regs )
+{
+	struct InternalState * iss = (struct InternalState*)(((struct ProgrammerStructBase*)dev)->internal);
+	int i;
+	MCF.WriteReg32( dev, DMABSTRACTAUTO, 0 ); // Disable Autoexec.
+	for( i = 0; i < 8; i++ )
+	{
+		MCF.WriteReg32( dev, DMDATA0, regs[i] );
+		MCF.WriteReg32( dev, DMCOMMAND, 0x00231008 + i ); // Write DATA0 into x8+i.
+	}
+	MCF.WriteReg32( dev, DMDATA1, regs[9] );
+	MCF.WriteReg32( dev, DMDATA0, regs[8] );
+	int r = MCF.WaitForDoneOp( dev );
+
+	// Nothing we parked in the hart's registers is there anymore.
+	iss->statetag = STTAG( "XXXX" );
+	if( MCF.VoidHighLevelState ) MCF.VoidHighLevelState( dev );
+	return r;
+}
+
+// Periodically halts the part, copies out new records from trace_buffer (see
+// ch32v003fun.h), resumes it and appends the events to a Chrome trace file.
+static int InternalTraceCapture( void * dev, const char * elffile, const char * outfile )
+{
+	if( !MCF.WriteReg32 || !MCF.ReadReg32 || !MCF.HaltMode || !MCF.ReadBinaryBlob )
+	{
+		fprintf( stderr, "Error: tracing needs a programmer with direct debug module access.\n" );
+		return -1;
+	}
+
+	struct ElfFile * elf = ElfLoad( elffile );
+	if( !elf ) return -9;
+
+	uint32_t tbaddr = 0, tbsize = 0, namessize = 0;
+	if( ElfFindSymbol( elf, "trace_buffer", &tbaddr, &tbsize ) )
+	{
+		fprintf( stderr, "Error: no trace_buffer in %s.  Was it built with -DENABLE_TRACE?\n", elffile );
+		ElfFree( elf );
+		return -9;
+	}
+	const uint8_t * names = ElfGetSection( elf, ".trace_names", 0, &namessize );
+
+	FILE * f = strcmp( outfile, "-" ) ? fopen( outfile, "w" ) : stdout;
+	if( !f )
+	{
+		fprintf( stderr, "Error: can't open write file \"%s\"\n", outfile );
+		ElfFree( elf );
+		return -9;
+	}
+
+	// Chrome and Perfetto are fine with the closing ] missing, so we can stream
+	// until the user kills us.
+	fprintf( f, "[\n" );
+
+	uint32_t * records = 0;
+	uint32_t tail = 0;
+	uint32_t lasttime = 0;
+	uint64_t now = 0;
+	uint64_t dropped = 0;
+	int first = 1;
+
+	fprintf( stderr, "Tracing from %08x, ^C to stop.\n", tbaddr );
+
+	while( 1 )
+	{
+		uint32_t regs[10];
+		uint32_t hdr[2];
+		uint32_t count = 0;
+		int r;
+
+		MCF.HaltMode( dev, 0 );
+		r = InternalSaveHartState( dev, regs );
+		if( r ) goto fail;
+		r = MCF.ReadBinaryBlob( dev, tbaddr, 8, (uint8_t*)hdr );
+		if( r ) goto fail;
+
+		uint32_t head = hdr[0];
+		uint32_t entries = hdr[1] & 0xffff;
+		uint32_t ticks_per_us = hdr[1] >> 16;
+		if( entries == 0 || ( entries & ( entries - 1 ) ) || 8 + entries * 8 > tbsize )
+		{
+			// Not set up yet.  Leave it alone and check back later.
+			InternalRestoreHartState( dev, regs );
+			MCF.HaltMode( dev, 2 );
+			InternalSleepMS( 10 );
+			continue;
+		}
+		if( !records )
+		{
+			records = malloc( entries * 8 );
+			tail = ( head > entries ) ? head - entries : 0;
+		}
+
+		count = head - tail;
+		if( count > entries )
+		{
+			dropped += count - entries;
+			fprintf( stderr, "Warning: trace ring overflowed, %llu events dropped so far\n", (unsigned long long)dropped );
+			tail = head - entries;
+			count = entries;
+		}
+
+		uint32_t start = tail & ( entries - 1 );
+		uint32_t firstrun = entries - start;
+		if( firstrun > count ) firstrun = count;
+		if( firstrun )
+			r |= MCF.ReadBinaryBlob( dev, tbaddr + 8 + start * 8, firstrun * 8, (uint8_t*)records );
+		if( count > firstrun )
+			r |= MCF.ReadBinaryBlob( dev, tbaddr + 8, ( count - firstrun ) * 8, (uint8_t*)( records + firstrun * 2 ) );
+
+		r |= InternalRestoreHartState( dev, regs );
+		MCF.HaltMode( dev, 2 );
+		if( r ) goto fail;
+
+		if( ticks_per_us == 0 ) ticks_per_us = 1;
+
+		uint32_t i;
+		for( i = 0; i < count; i++ )
+		{
+			uint32_t time = records[i*2+0];
+			uint32_t id = records[i*2+1] & 0x3fff;
+			int phase = ( records[i*2+1] >> 14 ) & 3;
+			uint32_t arg = records[i*2+1] >> 16;
+			char unnamed[16];
+			const char * name = unnamed;
+
+			// Unwrap the 32-bit SysTick into a 64-bit timeline.
+			now += (uint32_t)( time - lasttime );
+			lasttime = time;
+
+			if( names && id < namessize && memchr( names + id, 0, namessize - id ) )
+				name = (const char*)names + id;
+			else
+				sprintf( unnamed, "event%u", id );
+
+			fprintf( f, "%s{\"name\":\"%s\",\"ph\":\"%c\",%s\"ts\":%.3f,\"pid\":1,\"tid\":1,\"args\":{\"arg\":%u}}\n",
+				first ? "" : ",", name, "iBE?"[phase], ( phase == 0 ) ? "\"s\":\"g\"," : "",
+				(double)now / ticks_per_us, arg );
+			first = 0;
+		}
+		fflush( f );
+		tail = head;
+
+		// If the ring is filling up fast, don't wait around.
+		if( count < entries / 2 )
+			InternalSleepMS( 10 );
+	}
+
+fail:
+	fprintf( stderr, "Error: lost connection while tracing\n" );
+	free( records );
+	if( f != stdout ) fclose( f );
+	ElfFree( elf );
+	return -12;
+}
+
+
+#define CSR_TSELECT 0x7a0
+#define CSR_TDATA1  0x7a1
+#define CSR_TDATA2  0x7a2
+#define CSR_DCSR    0x7b0
+#define DCSR_STOPTIME (1<<9) // Hart-local timers (SysTick here) stop in debug mode.
+
+// mcontrol: type 2, debug mode only, halt on execute in M and U mode at tdata2.
+#define MCONTROL_EXECUTE_HALT 0x2800104c
+
+#define SYSTICK_CTLR 0xE000F000
+#define SYSTICK_CNT  0xE000F008
+
+// CSRs are reached by running csrw/csrr out of the PROGBUF.  Both clobber x8,
+// and the PROGBUF, so any programmer-side state is voided first.  Only valid
+// while halted.
+static int InternalWriteCSR( void * dev, uint16_t csr, uint32_t value )
+{
+	struct InternalState * iss = (struct InternalState*)(((struct ProgrammerStructBase*)dev)->internal);
+	if( MCF.VoidHighLevelState ) MCF.VoidHighLevelState( dev );
+	MCF.WriteReg32( dev, DMABSTRACTAUTO, 0 ); // Disable Autoexec.
+	MCF.WriteReg32( dev, DMPROGBUF0, ( csr << 20 ) | ( 8 << 15 ) | ( 1 << 12 ) | 0x73 ); // csrw csr, x8
+	MCF.WriteReg32( dev, DMPROGBUF1, 0x00019002 ); // c.ebreak
+	MCF.WriteReg32( dev, DMDATA0, value );
+	MCF.WriteReg32( dev, DMCOMMAND, 0x00271008 ); // Copy data to x8, and execute program.
+	iss->statetag = STTAG( "XXXX" );
+	return MCF.WaitForDoneOp( dev );
+}
+
+static int InternalReadCSR( void * dev, uint16_t csr, uint32_t * value )
+{
+	struct InternalState * iss = (struct InternalState*)(((struct ProgrammerStructBase*)dev)->internal);
+	int r;
+	if( MCF.VoidHighLevelState ) MCF.VoidHighLevelState( dev );
+	MCF.WriteReg32( dev, DMABSTRACTAUTO, 0 ); // Disable Autoexec.
+	MCF.WriteReg32( dev, DMPROGBUF0, ( csr << 20 ) | ( 2 << 12 ) | ( 8 << 7 ) | 0x73 ); // csrr x8, csr
+	MCF.WriteReg32( dev, DMPROGBUF1, 0x00019002 ); // c.ebreak
+	MCF.WriteReg32( dev, DMCOMMAND, 0x00241000 ); // Only execute.
+	iss->statetag = STTAG( "XXXX" );
+	if( ( r = MCF.WaitForDoneOp( dev ) ) ) return r;
+	MCF.WriteReg32( dev, DMCOMMAND, 0x00221008 ); // Read x8 into DATA0.
+	if( ( r = MCF.WaitForDoneOp( dev ) ) ) return r;
+	return MCF.ReadReg32( dev, DMDATA0, value );
+}
+
+static int InternalWaitForHalt( void * dev, int timeout_ms )
+{
+	uint64_t start = InternalTimeUS();
+	uint32_t dmstatus;
+	do
+	{
+		int r = MCF.ReadReg32( dev, DMSTATUS, &dmstatus );
+		if( r ) return r;
+		if( dmstatus & (1<<9) ) return 0; // allhalted
+	} while( InternalTimeUS() - start < timeout_ms * 1000ULL );
+	return -1;
+}
+
+// Halts on entry to a function with an execute trigger, then on its return
+// address, and reads SysTick at both stops.  dcsr.stoptime asks for SysTick to
+// stop in debug mode, and if it does, the only extra is the resume and halt
+// itself, which is timed around a single step and taken off every call.  If
+// SysTick keeps counting while halted, each call also picks up however far
+// into a status poll the halt landed, so that bound is printed with the
+// results, and min is the closest of them.
+static int InternalTimeFunction( void * dev, const char * elffile, const char * symbol, int calls )
+{
+	uint32_t regs[10];
+	uint32_t entry, ra, t0, t1, tdata1 = 0, stk_ctlr = 0, dcsr_orig = 0;
+	uint32_t poll_ticks = 0;
+	uint32_t overhead = 0xffffffff;
+	uint32_t min = 0xffffffff, max = 0;
+	uint64_t total = 0;
+	int done = 0;
+	int r = 0;
+	int i;
+
+	if( !MCF.WriteReg32 || !MCF.ReadReg32 || !MCF.HaltMode || !MCF.ReadWord || !MCF.WriteWord )
+	{
+		fprintf( stderr, "Error: --time-fn needs a programmer with direct debug module access.\n" );
+		return -1;
+	}
+	if( calls < 1 ) calls = 1;
+
+	struct ElfFile * e = ElfLoad( elffile );
+	if( !e ) return -9;
+	r = ElfFindSymbol( e, symbol, &entry, 0 );
+	ElfFree( e );
+	if( r )
+	{
+		fprintf( stderr, "Error: can't find \"%s\" in %s\n", symbol, elffile );
+		return -9;
+	}
+
+	MCF.HaltMode( dev, 0 );
+	if( InternalSaveHartState( dev, regs ) ) return -9;
+
+	r |= InternalWriteCSR( dev, CSR_TSELECT, 0 );
+	r |= InternalWriteCSR( dev, CSR_TDATA1, MCONTROL_EXECUTE_HALT );
+	r |= InternalReadCSR( dev, CSR_TDATA1, &tdata1 );
+	if( r || ( tdata1 >> 28 ) != 2 )
+	{
+		fprintf( stderr, "Error: This part doesn't have an execute trigger to use (tdata1 = %08x)\n", tdata1 );
+		InternalRestoreHartState( dev, regs );
+		MCF.HaltMode( dev, 2 );
+		return -1;
+	}
+	r |= InternalWriteCSR( dev, CSR_TDATA1, 0 );
+
+	// We need SysTick running to have anything to measure with.
+	int started_systick = 0;
+	r |= MCF.ReadWord( dev, SYSTICK_CTLR, &stk_ctlr );
+	if( !( stk_ctlr & 1 ) )
+	{
+		printf( "SysTick is off, running it from HCLK while timing.\n" );
+		r |= MCF.WriteWord( dev, SYSTICK_CTLR, (1<<2) | (1<<0) );
+		stk_ctlr = (1<<2) | (1<<0);
+		started_systick = 1;
+	}
+	int cycles_per_tick = ( stk_ctlr & (1<<2) ) ? 1 : 8;
+
+	// Ask for SysTick to stop while halted, then see if it really does.  If
+	// not, a handful of status polls tells us how late we can see a halt.
+	r |= InternalReadCSR( dev, CSR_DCSR, &dcsr_orig );
+	r |= InternalWriteCSR( dev, CSR_DCSR, dcsr_orig | DCSR_STOPTIME );
+	r |= MCF.ReadWord( dev, SYSTICK_CNT, &t0 );
+	for( i = 0; i < 4; i++ )
+		r |= MCF.ReadReg32( dev, DMSTATUS, &t1 );
+	r |= MCF.ReadWord( dev, SYSTICK_CNT, &t1 );
+	if( t1 != t0 )
+		poll_ticks = ( t1 - t0 + 3 ) / 4;
+
+	// Calibrate, by timing one single step with the same stop sequence.
+	for( i = 0; i < 8 && !r; i++ )
+	{
+		uint32_t dcsr;
+		r |= InternalReadCSR( dev, CSR_DCSR, &dcsr );
+		r |= InternalWriteCSR( dev, CSR_DCSR, dcsr | (1<<2) ); // step
+		r |= MCF.ReadWord( dev, SYSTICK_CNT, &t0 );
+		r |= InternalRestoreHartState( dev, regs );
+		MCF.HaltMode( dev, 2 );
+		if( InternalWaitForHalt( dev, 1000 ) ) { r = -1; break; }
+		r |= InternalSaveHartState( dev, regs );
+		r |= MCF.ReadWord( dev, SYSTICK_CNT, &t1 );
+		r |= InternalWriteCSR( dev, CSR_DCSR, dcsr & ~(1<<2) );
+		if( t1 - t0 < overhead ) overhead = t1 - t0;
+	}
+	if( r )
+	{
+		fprintf( stderr, "Error: Failed calibrating halt overhead.\n" );
+		goto cleanup;
+	}
+
+	r |= InternalWriteCSR( dev, CSR_TDATA2, entry );
+	r |= InternalWriteCSR( dev, CSR_TDATA1, MCONTROL_EXECUTE_HALT );
+	r |= InternalRestoreHartState( dev, regs );
+	MCF.HaltMode( dev, 2 );
+	printf( "Waiting for calls to %s (%08x)\n", symbol, entry );
+
+	for( done = 0; done < calls && !r; done++ )
+	{
+		if( InternalWaitForHalt( dev, 5000 ) )
+		{
+			fprintf( stderr, "Error: %s was not called (again) within 5 seconds.\n", symbol );
+			break;
+		}
+
+		// Sitting on the first instruction, break again wherever it returns to.
+		r |= InternalSaveHartState( dev, regs );
+		MCF.WriteReg32( dev, DMCOMMAND, 0x00221001 ); // Read x1 (ra) into DATA0.
+		r |= MCF.WaitForDoneOp( dev );
+		r |= MCF.ReadReg32( dev, DMDATA0, &ra );
+		r |= InternalWriteCSR( dev, CSR_TDATA2, ra );
+		r |= MCF.ReadWord( dev, SYSTICK_CNT, &t0 );
+		r |= InternalRestoreHartState( dev, regs );
+		MCF.HaltMode( dev, 2 );
+		if( InternalWaitForHalt( dev, 5000 ) )
+		{
+			fprintf( stderr, "Error: %s did not return within 5 seconds.\n", symbol );
+			break;
+		}
+		r |= InternalSaveHartState( dev, regs );
+		r |= MCF.ReadWord( dev, SYSTICK_CNT, &t1 );
+
+		uint32_t ticks = t1 - t0;
+		uint32_t cycles = ( ticks > overhead ? ticks - overhead : 0 ) * cycles_per_tick;
+		if( cycles < min ) min = cycles;
+		if( cycles > max ) max = cycles;
+		total += cycles;
+
+		if( done + 1 < calls )
+			r |= InternalWriteCSR( dev, CSR_TDATA2, entry );
+		r |= InternalRestoreHartState( dev, regs );
+		if( done + 1 < calls )
+			MCF.HaltMode( dev, 2 );
+	}
+
+cleanup:
+	// Leave the part running, with no trigger armed.
+	MCF.HaltMode( dev, 0 );
+	InternalSaveHartState( dev, regs );
+	InternalWriteCSR( dev, CSR_TDATA1, 0 );
+	InternalWriteCSR( dev, CSR_DCSR, dcsr_orig & ~(1<<2) );
+	if( started_systick )
+		MCF.WriteWord( dev, SYSTICK_CTLR, 0 );
+	InternalRestoreHartState( dev, regs );
+	MCF.HaltMode( dev, 2 );
+
+	if( done == 0 )
+		return r ? r : -1;
+
+	printf( "%s: %d calls, min %u avg %u max %u cycles\n", symbol, done, min, (uint32_t)( total / done ), max );
+	printf( "(%u cycles of halt overhead removed, resolution %d cycles)\n", overhead * cycles_per_tick, cycles_per_tick );
+	if( poll_ticks )
+		printf( "SysTick runs while this part is halted, so each call may read up to %u cycles long (one status poll); min is the closest.\n", poll_ticks * cycles_per_tick );
+	else
+		printf( "SysTick stops while this part is halted, so these are exact to the resolution.\n" );
+	return r;
+}
+
+#define CSR_DPC     0x7b1
+
+// The watchpoint path only ever touches x8 and DATA0 on the hart, so that's all
+// it saves, to keep the time the part spends halted per hit down.
+struct WatchSaved
+{
+	uint32_t x8;
+	uint32_t data0;
+};
+
+static int InternalWatchSave( void * dev, struct WatchSaved * ws )
+{
+	int r = 0;
+	MCF.WriteReg32( dev, DMABSTRACTAUTO, 0 ); // Disable Autoexec.
+	r |= MCF.ReadReg32( dev, DMDATA0, &ws->data0 );
+	MCF.WriteReg32( dev, DMCOMMAND, 0x00221008 ); // Read x8 into DATA0.
+	r |= MCF.WaitForDoneOp( dev );
+	r |= MCF.ReadReg32( dev, DMDATA0, &ws->x8 );
+	return r;
+}
+
+static int InternalWatchRestoreAndResume( void * dev, const struct WatchSaved * ws )
+{
+	MCF.WriteReg32( dev, DMDATA0, ws->x8 );
+	MCF.WriteReg32( dev, DMCOMMAND, 0x00231008 ); // Write DATA0 into x8.
+	MCF.WriteReg32( dev, DMDATA0, ws->data0 );
+	if( MCF.VoidHighLevelState ) MCF.VoidHighLevelState( dev );
+	return MCF.HaltMode( dev, 2 );
+}
+
+// Reads a word using only x8.
+static int InternalWatchPeek( void * dev, uint32_t address, uint32_t * value )
+{
+	int r;
+	MCF.WriteReg32( dev, DMPROGBUF0, 0x90024000 ); // c.lw x8,0(x8); c.ebreak
+	MCF.WriteReg32( dev, DMDATA0, address );
+	MCF.WriteReg32( dev, DMCOMMAND, 0x00271008 ); // Copy data to x8, and execute program.
+	if( ( r = MCF.WaitForDoneOp( dev ) ) ) return r;
+	MCF.WriteReg32( dev, DMCOMMAND, 0x00221008 ); // Read x8 into DATA0.
+	if( ( r = MCF.WaitForDoneOp( dev ) ) ) return r;
+	return MCF.ReadReg32( dev, DMDATA0, value );
+}
+
+static volatile sig_atomic_t watch_interrupted;
+
+static void InternalWatchSigInt( int sig )
+{
+	watch_interrupted = 1;
+}
+
+// Arms a load/store trigger on address.  In count mode, each hit is stepped
+// over (with the trigger off so it doesn't fire again straight away), the new
+// value read back and logged with the PC, and the part carries on.  In stop
+// mode, the part is left halted on the first access.  Gives up after
+// timeout_s seconds or on Ctrl+C; either way the trigger is disarmed and dcsr
+// put back before returning.
+static int InternalWatch( void * dev, uint32_t address, int match_bits, int stop, int hits, int timeout_s )
+{
+	struct InternalState * iss = (struct InternalState*)(((struct ProgrammerStructBase*)dev)->internal);
+	struct WatchSaved ws;
+	uint32_t armed = MCONTROL_EXECUTE_HALT & ~(1<<2); // Not execute.
+	uint32_t tdata1 = 0, dcsr = 0, pc = 0, value = 0;
+	uint64_t deadline = InternalTimeUS() + timeout_s * 1000000ULL;
+	void (*prev_sigint)( int );
+	int have_dcsr = 0;
+	int held = 0; // Halted, with x8 and DATA0 in ws.
+	int leave_halted = 0;
+	int r = 0;
+	int hit;
+
+	if( !MCF.WriteReg32 || !MCF.ReadReg32 || !MCF.HaltMode )
+	{
+		fprintf( stderr, "Error: --watch needs a programmer with direct debug module access.\n" );
+		return -1;
+	}
+	armed |= match_bits & 3; // 1 = load, 2 = store
+
+	MCF.HaltMode( dev, 0 );
+	if( InternalWaitForHalt( dev, 100 ) )
+	{
+		fprintf( stderr, "Error: Could not halt part.\n" );
+		return -9;
+	}
+	watch_interrupted = 0;
+	prev_sigint = signal( SIGINT, InternalWatchSigInt );
+
+	r |= InternalWatchSave( dev, &ws );
+	held = 1;
+	r |= InternalReadCSR( dev, CSR_DCSR, &dcsr );
+	have_dcsr = !r;
+	r |= InternalWriteCSR( dev, CSR_TSELECT, 0 );
+	r |= InternalWriteCSR( dev, CSR_TDATA2, address );
+	r |= InternalWriteCSR( dev, CSR_TDATA1, armed );
+	r |= InternalReadCSR( dev, CSR_TDATA1, &tdata1 );
+	if( r || ( tdata1 & 3 ) != ( armed & 3 ) )
+	{
+		fprintf( stderr, "Error: This part doesn't have a load/store trigger to use (tdata1 = %08x)\n", tdata1 );
+		r = -1;
+		goto cleanup;
+	}
+	r |= InternalWatchPeek( dev, address, &value );
+	printf( "Watching %s of %08x (currently %08x)\n", ( match_bits == 3 ) ? "loads and stores" : ( match_bits == 1 ) ? "loads" : "stores", address, value );
+	r |= InternalWatchRestoreAndResume( dev, &ws );
+	held = 0;
+
+	for( hit = 0; hit < hits && !r; hit++ )
+	{
+		int w;
+		do
+			w = InternalWaitForHalt( dev, 100 );
+		while( w == -1 && !watch_interrupted && InternalTimeUS() < deadline );
+		if( w == -1 )
+		{
+			fprintf( stderr, "%s after %d hit(s).\n", watch_interrupted ? "Interrupted" : "Timed out", hit );
+			break;
+		}
+		if( ( r = w ) ) break;
+
+		r |= InternalWatchSave( dev, &ws );
+		held = 1;
+		r |= InternalReadCSR( dev, CSR_DPC, &pc );
+		if( stop )
+		{
+			r |= InternalWatchPeek( dev, address, &value );
+			printf( "Hit: pc %08x, value %08x before access.  Part left halted.\n", pc, value );
+			leave_halted = 1;
+			break;
+		}
+
+		// Step over the access with the trigger off.
+		r |= InternalWriteCSR( dev, CSR_TDATA1, 0 );
+		r |= InternalWriteCSR( dev, CSR_DCSR, dcsr | (1<<2) );
+		r |= InternalWatchRestoreAndResume( dev, &ws );
+		held = 0;
+		if( InternalWaitForHalt( dev, 1000 ) )
+		{
+			fprintf( stderr, "Error: Part didn't come back from single step.\n" );
+			r = -9;
+			break;
+		}
+		r |= InternalWatchSave( dev, &ws );
+		held = 1;
+		r |= InternalWatchPeek( dev, address, &value );
+		r |= InternalWriteCSR( dev, CSR_DCSR, dcsr & ~(1<<2) );
+		if( hit + 1 < hits )
+			r |= InternalWriteCSR( dev, CSR_TDATA1, armed );
+		r |= InternalWatchRestoreAndResume( dev, &ws );
+		held = 0;
+		printf( "%d: pc %08x, value %08x\n", hit, pc, value );
+		fflush( stdout );
+	}
+
+cleanup:
+	// Whatever got us here, don't leave the trigger armed or the part stepping.
+	if( !held )
+	{
+		MCF.HaltMode( dev, 0 );
+		InternalWaitForHalt( dev, 100 );
+		InternalWatchSave( dev, &ws );
+	}
+	InternalWriteCSR( dev, CSR_TSELECT, 0 );
+	InternalWriteCSR( dev, CSR_TDATA1, 0 );
+	if( have_dcsr )
+		InternalWriteCSR( dev, CSR_DCSR, dcsr );
+	if( leave_halted )
+	{
+		// Put x8 back, but stay halted.
+		MCF.WriteReg32( dev, DMDATA0, ws.x8 );
+		MCF.WriteReg32( dev, DMCOMMAND, 0x00231008 ); // Write DATA0 into x8.
+		MCF.WriteReg32( dev, DMDATA0, ws.data0 );
+		if( MCF.VoidHighLevelState ) MCF.VoidHighLevelState( dev );
+	}
+	else
+		InternalWatchRestoreAndResume( dev, &ws );
+	iss->statetag = STTAG( "XXXX" );
+	signal( SIGINT, prev_sigint );
+	return r;
+}
+
+// Deferred logging, see DLOG() in ch32v003fun.h.  Messages come in mixed in
+// with ordinary printf text: a word of 0x1e, the argument count and the 16-bit
+// offset of the format in .dlog_strings, then the arguments, all little endian.
+struct DLogDecoder
+{
+	char * strings;
+	uint32_t stringssize;
+	uint8_t msg[4+4*4];
+	int have; // Bytes of the current message so far; 0 between messages.
+};
+
+static struct DLogDecoder * InternalDLogOpen( const char * elffile )
+{
+	struct ElfFile * elf = ElfLoad( elffile );
+	const uint8_t * strings;
+	uint32_t size = 0;
+	if( !elf ) return 0;
+	strings = ElfGetSection( elf, ".dlog_strings", 0, &size );
+	if( !strings )
+	{
+		fprintf( stderr, "Error: no .dlog_strings in %s.  Was it built with -DENABLE_DLOG?\n", elffile );
+		ElfFree( elf );
+		return 0;
+	}
+	struct DLogDecoder * dl = calloc( 1, sizeof( struct DLogDecoder ) );
+	dl->strings = calloc( 1, size + 1 );
+	memcpy( dl->strings, strings, size );
+	dl->stringssize = size;
+	ElfFree( elf );
+	return dl;
+}
+
+static void InternalDLogPrint( struct DLogDecoder * dl )
+{
+	uint32_t id = dl->msg[2] | ( dl->msg[3] << 8 );
+	int nargs = dl->msg[1];
+	uint32_t args[4];
+	int a = 0;
+	memcpy( args, dl->msg + 4, nargs * 4 );
+	if( id >= dl->stringssize )
+	{
+		printf( "<dlog: bad format offset %04x>\n", id );
+		return;
+	}
+
+	const char * f = dl->strings + id;
+	while( *f )
+	{
+		if( *f != '%' )
+		{
+			putchar( *f++ );
+			continue;
+		}
+
+		// Flags and width are passed on to printf; length modifiers don't
+		// matter since everything arrives as 32 bits.
+		char spec[16];
+		int n = 0;
+		spec[n++] = *f++;
+		while( *f && strchr( "-+ #0123456789.lh", *f ) )
+		{
+			if( *f != 'l' && *f != 'h' && n < 12 ) spec[n++] = *f;
+			f++;
+		}
+		char conv = *f ? *f++ : 0;
+		if( conv == '%' )
+		{
+			putchar( '%' );
+			continue;
+		}
+		if( a >= nargs )
+		{
+			fputs( "<?>", stdout );
+			continue;
+		}
+		uint32_t v = args[a++];
+		switch( conv )
+		{
+		case 'd': case 'i':
+			spec[n++] = 'd'; spec[n] = 0;
+			printf( spec, (int32_t)v );
+			break;
+		case 'u': case 'x': case 'X': case 'o': case 'c':
+			spec[n++] = conv; spec[n] = 0;
+			printf( spec, v );
+			break;
+		case 's':
+			printf( "<str@%08x>", v );
+			break;
+		default:
+			printf( "0x%08x", v );
+			break;
+		}
+	}
+}
+
+static void InternalDLogFeed( struct DLogDecoder * dl, const uint8_t * data, int len )
+{
+	int i;
+	for( i = 0; i < len; i++ )
+	{
+		uint8_t c = data[i];
+		if( !dl->have )
+		{
+			if( c == 0x1e )
+				dl->msg[dl->have++] = c;
+			else
+				putchar( c );
+			continue;
+		}
+		dl->msg[dl->have++] = c;
+		if( dl->have >= 2 && dl->msg[1] > 4 )
+		{
+			// Not one of ours after all.
+			fwrite( dl->msg, dl->have, 1, stdout );
+			dl->have = 0;
+		}
+		else if( dl->have >= 4 && dl->have == 4 + dl->msg[1] * 4 )
+		{
+			InternalDLogPrint( dl );
+			dl->have = 0;
+		}
+	}
+	fflush( stdout );
+}
+
+static int InternalDLogDecodeFile( const char * elffile, const char * capture )
+{
+	struct DLogDecoder * dl = InternalDLogOpen( elffile );
+	uint8_t buffer[256];
+	int r;
+	if( !dl ) return -9;
+	FILE * f = fopen( capture, "rb" );
+	if( !f )
+	{
+		fprintf( stderr, "Error: can't open %s\n", capture );
+		return -9;
+	}
+	while( ( r = fread( buffer, 1, sizeof( buffer ), f ) ) > 0 )
+		InternalDLogFeed( dl, buffer, r );
+	fclose( f );
+	return 0;
+}
+
+// Semihosting: the part runs slli x0,x0,0x1f / ebreak / srai x0,x0,7 with an op
+// in a0 and a pointer to its arguments in a1 (see ch32v003fun.h), and with
+// dcsr.ebreakm set that ebreak halts it.  The terminal loop checks for that
+// when there's no text waiting.  Buffers go over with ReadBinaryBlob and
+// WriteBinaryBlob, so a big SYS_WRITE is one streamed transfer.
+#define SEMIHOST_SYS_OPEN  0x01
+#define SEMIHOST_SYS_CLOSE 0x02
+#define SEMIHOST_SYS_WRITE 0x05
+#define SEMIHOST_SYS_READ  0x06
+
+// The blob functions want whole words, so go through an aligned copy.
+static int InternalSemihostReadTarget( void * dev, uint32_t address, uint32_t len, uint8_t * out )
+{
+	uint32_t start = address & ~3;
+	uint32_t end = ( address + len + 3 ) & ~3;
+	uint8_t * tmp = malloc( end - start + 4 );
+	int r = MCF.ReadBinaryBlob( dev, start, end - start, tmp );
+	if( !r ) memcpy( out, tmp + ( address - start ), len );
+	free( tmp );
+	return r;
+}
+
+static int InternalSemihostWriteTarget( void * dev, uint32_t address, uint32_t len, const uint8_t * in )
+{
+	uint32_t start = address & ~3;
+	uint32_t end = ( address + len + 3 ) & ~3;
+	uint8_t * tmp = malloc( end - start + 4 );
+	int r = 0;
+	// Keep whatever shares the first and last words with the buffer.
+	if( start != address || end != address + len )
+	{
+		r |= InternalSemihostReadTarget( dev, start, 4, tmp );
+		r |= InternalSemihostReadTarget( dev, end - 4, 4, tmp + ( end - start - 4 ) );
+	}
+	memcpy( tmp + ( address - start ), in, len );
+	if( !r ) r = MCF.WriteBinaryBlob( dev, start, end - start, tmp );
+	free( tmp );
+	return r;
+}
+
+// Services one call.  Returns 1 if the part was halted for something else.
+static int InternalSemihostCall( void * dev )
+{
+	static const char * modes[12] = { "r", "rb", "r+", "r+b", "w", "wb", "w+", "w+b", "a", "ab", "a+", "a+b" };
+	struct InternalState * iss = (struct InternalState*)(((struct ProgrammerStructBase*)dev)->internal);
+	uint32_t regs[10];
+	uint32_t dpc = 0, pre = 0, post = 0, args[3] = { 0 };
+	int32_t ret = -1;
+	int r;
+
+	if( ( r = InternalSaveHartState( dev, regs ) ) ) return r;
+	r |= InternalReadCSR( dev, CSR_DPC, &dpc );
+	if( !r && !( dpc & 3 ) )
+	{
+		r |= MCF.ReadWord( dev, dpc - 4, &pre );
+		r |= MCF.ReadWord( dev, dpc + 4, &post );
+	}
+	if( r || pre != 0x01f01013 || post != 0x40705013 )
+	{
+		InternalRestoreHartState( dev, regs );
+		fprintf( stderr, "Part halted at %08x, not on a semihosting call\n", dpc );
+		return r ? r : 1;
+	}
+
+	uint32_t op = regs[2];    // a0
+	uint32_t argp = regs[3];  // a1
+	r |= InternalSemihostReadTarget( dev, argp, sizeof( args ), (uint8_t*)args );
+	uint32_t fd = args[0];
+	FILE * f = ( fd < SEMIHOST_MAX_FILES ) ? iss->semihost_files[fd] : 0;
+
+	switch( r ? 0 : op )
+	{
+	case SEMIHOST_SYS_OPEN:
+	{
+		// { name, mode, length of name }
+		char name[256];
+		uint32_t namelen = args[2];
+		if( namelen >= sizeof( name ) || args[1] > 11 ) break;
+		if( ( r = InternalSemihostReadTarget( dev, args[0], namelen, (uint8_t*)name ) ) ) break;
+		name[namelen] = 0;
+		if( strcmp( name, ":tt" ) == 0 )
+		{
+			ret = ( args[1] < 4 ) ? 0 : 1;
+			break;
+		}
+		for( fd = 3; fd < SEMIHOST_MAX_FILES; fd++ )
+			if( !iss->semihost_files[fd] ) break;
+		if( fd == SEMIHOST_MAX_FILES ) break;
+		iss->semihost_files[fd] = fopen( name, modes[args[1]] );
+		if( iss->semihost_files[fd] ) ret = fd;
+		break;
+	}
+	case SEMIHOST_SYS_CLOSE:
+		if( fd < 3 ) ret = 0;
+		else if( f )
+		{
+			fclose( f );
+			iss->semihost_files[fd] = 0;
+			ret = 0;
+		}
+		break;
+	case SEMIHOST_SYS_WRITE:
+	case SEMIHOST_SYS_READ:
+	{
+		// { fd, buffer, length }.  Both return the number of bytes NOT moved.
+		uint32_t len = args[2];
+		uint8_t * buffer;
+		if( !f || len > 0x10000 ) break;
+		buffer = malloc( len + 4 );
+		if( op == SEMIHOST_SYS_WRITE )
+		{
+			r = InternalSemihostReadTarget( dev, args[1], len, buffer );
+			if( !r ) ret = len - fwrite( buffer, 1, len, f );
+			if( f == stdout ) fflush( stdout );
+		}
+		else
+		{
+			uint32_t got = fread( buffer, 1, len, f );
+			if( got ) r = InternalSemihostWriteTarget( dev, args[1], got, buffer );
+			if( !r ) ret = len - got;
+		}
+		free( buffer );
+		break;
+	}
+	default:
+		fprintf( stderr, "Warning: unsupported semihosting op %d\n", op );
+		break;
+	}
+
+	// Hand back the result and carry on after the ebreak.
+	regs[2] = ret;
+	r |= InternalWriteCSR( dev, CSR_DPC, dpc + 4 );
+	r |= InternalRestoreHartState( dev, regs );
+	r |= MCF.HaltMode( dev, 2 );
+	return r;
+}
+
+static int InternalTerminal( void * dev, int semihost, struct DLogDecoder * dlog )
+{
+	struct InternalState * iss = (struct InternalState*)(((struct ProgrammerStructBase*)dev)->internal);
+	if( semihost )
+	{
+		uint32_t regs[10];
+		uint32_t dcsr = 0;
+		int r;
+		if( !MCF.WriteReg32 || !MCF.ReadReg32 || !MCF.HaltMode || !MCF.ReadWord || !MCF.ReadBinaryBlob || !MCF.WriteBinaryBlob )
+		{
+			fprintf( stderr, "Error: --semihost needs a programmer with direct debug module access.\n" );
+			return -1;
+		}
+		iss->semihost_files[0] = stdin;
+		iss->semihost_files[1] = stdout;
+		iss->semihost_files[2] = stderr;
+
+		// Make ebreak in machine mode drop into debug mode instead of trapping.
+		MCF.HaltMode( dev, 0 );
+		if( ( r = InternalSaveHartState( dev, regs ) ) ) return r;
+		r |= InternalReadCSR( dev, CSR_DCSR, &dcsr );
+		r |= InternalWriteCSR( dev, CSR_DCSR, dcsr | (1<<15) );
+		r |= InternalRestoreHartState( dev, regs );
+		r |= MCF.HaltMode( dev, 2 );
+		if( r ) return r;
+	}
+
+	do
+	{
+		uint8_t buffer[256];
+		int r = MCF.PollTerminal( dev, buffer, sizeof( buffer ), 0, 0 );
+		if( r < 0 )
+		{
+			fprintf( stderr, "Terminal dead.  code %d\n", r );
+			return -32;
+		}
+		if( r > 0 )
+		{
+			if( dlog )
+				InternalDLogFeed( dlog, buffer, r );
+			else
+				fwrite( buffer, r, 1, stdout ); 
+		}
+		else if( semihost )
+		{
+			uint32_t dmstatus = 0;
+			if( MCF.ReadReg32( dev, DMSTATUS, &dmstatus ) ) return -32;
+			if( dmstatus & (1<<9) ) // allhalted
+			{
+				r = InternalSemihostCall( dev );
+				if( r ) return ( r > 0 ) ? 0 : r;
+			}
+		}
+	} while( 1 );
+}
+
+// Fill, copy and compare, as loops in the PROGBUF, so only the parameters and
+// the result cross the link.  Everything is in whole words.  They all clobber
+// x8, x9, x13, x14 and x15 (and x10 for compare).  Flash can't be written
+// with plain stores, so fills and copies into flash go through WriteBinaryBlob.
+static int InternalTargetLoop( void * dev, const uint32_t * prog, int words, uint32_t x8, uint32_t x9, uint32_t x14, uint32_t x15 )
+{
+	struct InternalState * iss = (struct InternalState*)(((struct ProgrammerStructBase*)dev)->internal);
+	int i;
+	if( MCF.VoidHighLevelState ) MCF.VoidHighLevelState( dev );
+	MCF.WriteReg32( dev, DMABSTRACTAUTO, 0 ); // Disable Autoexec.
+	for( i = 0; i < words; i++ )
+		MCF.WriteReg32( dev, DMPROGBUF0 + i, prog[i] );
+	iss->statetag = STTAG( "XXXX" );
+
+	MCF.WriteReg32( dev, DMDATA0, 0xe00000f4 );
+	MCF.WriteReg32( dev, DMCOMMAND, 0x0023100a ); // Copy data to x10 (&DATA0)
+	MCF.WriteReg32( dev, DMDATA0, x8 );
+	MCF.WriteReg32( dev, DMCOMMAND, 0x00231008 ); // Copy data to x8
+	MCF.WriteReg32( dev, DMDATA0, x14 );
+	MCF.WriteReg32( dev, DMCOMMAND, 0x0023100e ); // Copy data to x14
+	MCF.WriteReg32( dev, DMDATA0, x15 );
+	MCF.WriteReg32( dev, DMCOMMAND, 0x0023100f ); // Copy data to x15
+	MCF.WriteReg32( dev, DMDATA0, x9 );
+	MCF.WriteReg32( dev, DMCOMMAND, 0x00271009 ); // Copy data to x9, and execute program.
+	return MCF.WaitForDoneOp( dev );
+}
+
+static int InternalBulkOp( void * dev, const char * op, uint32_t a, uint32_t b, uint32_t c )
+{
+	// 1: c.sw x14, 0(x9)
+	//    c.addi x9, 4
+	//    bne x9, x8, 1b
+	//    c.ebreak
+	static const uint32_t fill[] = { 0x0491c098, 0xfe849ee3, 0x00009002 };
+	// 1: c.lw x14, 0(x9)
+	//    c.sw x14, 0(x15)
+	//    c.addi x9, 4
+	//    c.addi x15, 4
+	//    bne x9, x8, 1b
+	//    c.ebreak
+	static const uint32_t copy_forward[] = { 0xc3984098, 0x07910491, 0xfe849ce3, 0x00009002 };
+	// 1: c.addi x9, -4
+	//    c.addi x15, -4
+	//    c.lw x14, 0(x9)
+	//    c.sw x14, 0(x15)
+	//    bne x9, x8, 1b
+	//    c.ebreak
+	static const uint32_t copy_backward[] = { 0x17f114f1, 0xc3984098, 0xfe849ce3, 0x00009002 };
+	// 1: c.lw x14, 0(x9)
+	//    c.lw x13, 0(x15)
+	//    bne x14, x13, 2f
+	//    c.addi x9, 4
+	//    c.addi x15, 4
+	//    bne x9, x8, 1b
+	// 2: c.sw x9, 0(x10)  // Where it stopped to DATA0
+	//    c.ebreak
+	static const uint32_t compare[] = { 0x43944098, 0x00d71663, 0x07910491, 0xfe849ae3, 0x9002c104 };
+
+	uint64_t start = InternalTimeUS();
+	uint32_t len = ( strcmp( op, "fill" ) == 0 ) ? b : c;
+	uint8_t * buffer = 0;
+	int r = 0;
+
+	if( !MCF.WriteReg32 || !MCF.ReadReg32 || !MCF.ReadWord || !MCF.WriteBinaryBlob || !MCF.ReadBinaryBlob )
+	{
+		fprintf( stderr, "Error: --%s needs a programmer with direct debug module access.\n", op );
+		return -1;
+	}
+	if( ( a | len | ( ( strcmp( op, "fill" ) == 0 ) ? 0 : b ) ) & 3 )
+	{
+		fprintf( stderr, "Error: --%s works on whole words; addresses and length must be multiples of 4.\n", op );
+		return -44;
+	}
+	if( len == 0 ) return 0;
+
+	if( strcmp( op, "fill" ) == 0 )
+	{
+		if( InternalIsFlash( a ) )
+		{
+			uint32_t i;
+			buffer = malloc( len );
+			for( i = 0; i < len; i += 4 )
+				memcpy( buffer + i, &c, 4 );
+			r = MCF.WriteBinaryBlob( dev, a, len, buffer );
+		}
+		else
+			r = InternalTargetLoop( dev, fill, 3, a + len, a, c, 0 );
+	}
+	else if( strcmp( op, "copy" ) == 0 )
+	{
+		if( InternalIsFlash( b ) )
+		{
+			buffer = malloc( len );
+			r = MCF.ReadBinaryBlob( dev, a, len, buffer );
+			if( !r ) r = MCF.WriteBinaryBlob( dev, b, len, buffer );
+		}
+		else if( b > a && b < a + len )
+			r = InternalTargetLoop( dev, copy_backward, 4, a, a + len, 0, b + len ); // Overlapping; go from the top.
+		else
+			r = InternalTargetLoop( dev, copy_forward, 4, a + len, a, 0, b );
+	}
+	else
+	{
+		uint32_t stop = 0;
+		r = InternalTargetLoop( dev, compare, 5, a + len, a, 0, b );
+		if( !r ) r = MCF.ReadReg32( dev, DMDATA0, &stop );
+		if( !r && stop != a + len )
+		{
+			uint32_t va = 0, vb = 0;
+			// The compare stub replaced PROGBUF under the programmer's feet.
+			if( MCF.VoidHighLevelState ) MCF.VoidHighLevelState( dev );
+			MCF.ReadWord( dev, stop, &va );
+			MCF.ReadWord( dev, b + ( stop - a ), &vb );
+			printf( "Differ at offset %08x: %08x = %08x, %08x = %08x\n", stop - a, stop, va, b + ( stop - a ), vb );
+			r = -14;
+		}
+		else if( !r )
+			printf( "Same\n" );
+	}
+	if( MCF.VoidHighLevelState ) MCF.VoidHighLevelState( dev );
+	free( buffer );
+	if( r ) return r;
+
+	fprintf( stderr, "%s: %d bytes in %d us\n", op, len, (int)( InternalTimeUS() - start ) );
+	return 0;
+}
+
+// Hash used by the on-chip diff stub: h = h * 33 ^ word, over whole words.
+#define DIFF_HASH_SEED 5381
+#define DIFF_DIRECT_SIZE 64
+
+static uint32_t InternalDiffHash( const uint8_t * data, uint32_t len )
+{
+	uint32_t h = DIFF_HASH_SEED;
+	uint32_t i;
+	for( i = 0; i < len; i += 4 )
+	{
+		uint32_t w;
+		memcpy( &w, data + i, 4 );
+		h = ( h * 33 ) ^ w;
+	}
+	return h;
+}
+
+// Has the part hash [address, address+len) for us.  len must be a nonzero
+// multiple of 4.  Clobbers x8, x9, x14 and x15.
+static int InternalTargetHash( void * dev, uint32_t address, uint32_t len, uint32_t * hash )
+{
+	struct InternalState * iss = (struct InternalState*)(((struct ProgrammerStructBase*)dev)->internal);
+	int r;
+
+	// Programmers that cache their own PROGBUF contents may have reloaded it
+	// since we last ran (e.g. a direct ReadBinaryBlob between hashes), so we
+	// can't trust our statetag across calls with them.
+	if( MCF.VoidHighLevelState )
+	{
+		MCF.VoidHighLevelState( dev );
+		iss->statetag = STTAG( "XXXX" );
+	}
+
+	if( iss->statetag != STTAG( "HASH" ) )
+	{
+		MCF.WriteReg32( dev, DMABSTRACTAUTO, 0 ); // Disable Autoexec.
+		// 1: c.mv x15, x14
+		//    c.slli x15, 5
+		MCF.WriteReg32( dev, DMPROGBUF0, 0x079687ba );
+		//    c.add x14, x15   // h *= 33
+		//    c.lw x15, 0(x9)
+		MCF.WriteReg32( dev, DMPROGBUF1, 0x409c973e );
+		//    c.xor x14, x15   // h ^= *ptr
+		//    c.addi x9, 4
+		MCF.WriteReg32( dev, DMPROGBUF2, 0x04918f3d );
+		//    bne x9, x8, 1b
+		MCF.WriteReg32( dev, DMPROGBUF3, 0xfe849ae3 );
+		//    c.sw x14, 0(x10) // Result to DATA0
+		//    c.ebreak
+		MCF.WriteReg32( dev, DMPROGBUF4, 0x9002c118 );
+
+		// x10 has to point at DATA0.
+		MCF.WriteReg32( dev, DMDATA0, 0xe00000f4 );
+		MCF.WriteReg32( dev, DMCOMMAND, 0x0023100a ); // Copy data to x10
+		iss->statetag = STTAG( "HASH" );
+	}
+
+	MCF.WriteReg32( dev, DMDATA0, address + len );
+	MCF.WriteReg32( dev, DMCOMMAND, 0x00231008 ); // Copy data to x8 (end)
+	MCF.WriteReg32( dev, DMDATA0, DIFF_HASH_SEED );
+	MCF.WriteReg32( dev, DMCOMMAND, 0x0023100e ); // Copy data to x14 (hash)
+	MCF.WriteReg32( dev, DMDATA0, address );
+	MCF.WriteReg32( dev, DMCOMMAND, 0x00271009 ); // Copy data to x9 (pointer), and execute program.
+	r = MCF.WaitForDoneOp( dev );
+	if( r ) return r;
+	return MCF.ReadReg32( dev, DMDATA0, hash );
+}
+
+struct DiffState
+{
+	uint32_t run_start;
+	uint32_t run_end;
+	int runs;
+	uint32_t bytes_read;
+};
+
+static void InternalDiffFlush( struct DiffState * ds )
+{
+	if( ds->run_end != ds->run_start )
+		printf( "Differs: %08x - %08x (%d bytes)\n", ds->run_start, ds->run_end - 1, ds->run_end - ds->run_start );
+	ds->run_start = ds->run_end;
+}
+
+static void InternalDiffMark( struct DiffState * ds, uint32_t address )
+{
+	if( ds->run_end != ds->run_start && ds->run_end == address )
+	{
+		ds->run_end++;
+		return;
+	}
+	InternalDiffFlush( ds );
+	ds->run_start = address;
+	ds->run_end = address + 1;
+	ds->runs++;
+}
+
+// Small blocks, and everything on programmers that can't run code on the part,
+// are just read back and compared.  Otherwise hash, and only split what differs.
+static int InternalDiffRange( void * dev, uint32_t address, const uint8_t * expected, uint32_t len, struct DiffState * ds, int can_hash )
+{
+	int r;
+	if( len == 0 ) return 0;
+
+	if( !can_hash || len <= DIFF_DIRECT_SIZE )
+	{
+		uint8_t * readback = malloc( len );
+		r = MCF.ReadBinaryBlob( dev, address, len, readback );
+		if( r == 0 )
+		{
+			uint32_t i;
+			for( i = 0; i < len; i++ )
+				if( readback[i] != expected[i] )
+					InternalDiffMark( ds, address + i );
+		}
+		ds->bytes_read += len;
+		free( readback );
+		return r;
+	}
+
+	if( len & 3 )
+	{
+		r = InternalDiffRange( dev, address, expected, len & ~3, ds, can_hash );
+		if( r ) return r;
+		return InternalDiffRange( dev, address + ( len & ~3 ), expected + ( len & ~3 ), len & 3, ds, can_hash );
+	}
+
+	uint32_t hash;
+	r = InternalTargetHash( dev, address, len, &hash );
+	if( r ) return r;
+	if( hash == InternalDiffHash( expected, len ) )
+		return 0;
+
+	uint32_t half = ( len / 2 + 3 ) & ~3;
+	r = InternalDiffRange( dev, address, expected, half, ds, can_hash );
+	if( r ) return r;
+	return InternalDiffRange( dev, address + half, expected + half, len - half, ds, can_hash );
+}
+
+static int InternalDiff( void * dev, const char * fname, uint32_t address )
+{
+	struct DiffState ds = { 0 };
+	int can_hash = MCF.WriteReg32 && MCF.ReadReg32 && MCF.WaitForDoneOp && ( address & 3 ) == 0;
+
+	if( !MCF.ReadBinaryBlob )
+	{
+		fprintf( stderr, "Error: Can't read memory on this programmer.\n" );
+		return -1;
+	}
+
+	FILE * f = fopen( fname, "rb" );
+	if( !f )
+	{
+		fprintf( stderr, "Error: can't open file \"%s\"\n", fname );
+		return -9;
+	}
+	fseek( f, 0, SEEK_END );
+	long len = ftell( f );
+	fseek( f, 0, SEEK_SET );
+	uint8_t * image = malloc( len + 1 );
+	int status = ( len == 0 ) || fread( image, len, 1, f ) == 1;
+	fclose( f );
+	if( !status )
+	{
+		fprintf( stderr, "Error: File I/O Fault.\n" );
+		free( image );
+		return -10;
+	}
+
+	int r = InternalDiffRange( dev, address, image, len, &ds, can_hash );
+	free( image );
+
+	// The stub used registers the other programs rely on.
+	if( can_hash )
+	{
+		((struct InternalState*)(((struct ProgrammerStructBase*)dev)->internal))->statetag = STTAG( "XXXX" );
+		if( MCF.VoidHighLevelState ) MCF.VoidHighLevelState( dev );
+	}
+
+	if( r )
+	{
+		fprintf( stderr, "Error: Fault reading device\n" );
+		return r;
+	}
+
+	InternalDiffFlush( &ds );
+	if( ds.runs == 0 )
+		printf( "No differences in %d bytes (read %d directly)\n", (int)len, ds.bytes_read );
+	else
+		printf( "%d differing range(s) in %d bytes (read %d directly)\n", ds.runs, (int)len, ds.bytes_read );
+	return ds.runs;
+}
+#endif
 
 void TestFunction(void * dev )
 {
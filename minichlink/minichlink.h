@@ -2,9 +2,19 @@
 #define _MINICHLINK_H
 
 #include <stdint.h>
+#include <stdio.h>
+
+// Bumped whenever a library-visible struct or function changes incompatibly.
+#define MINICHLINK_API_VERSION 1
 
 struct MiniChlinkFunctions
 {
+	// Filled in by MiniChlinkOpen, so library users can check they were built
+	// against the same layout: api_version == MINICHLINK_API_VERSION and
+	// struct_size == sizeof( struct MiniChlinkFunctions ).
+	uint32_t api_version;
+	uint32_t struct_size;
+
 	// All functions return 0 if OK, negative number if fault, positive number as status code.
 
 	// Low-level functions, if they exist.
@@ -43,9 +53,9 @@ struct MiniChlinkFunctions
 	// Geared for flash, but could be anything.
 	int (*BlockWrite64)( void * dev, uint32_t address_to_write, uint8_t * data );
 
-	// TODO: What about 64-byte block-reads?
-	// TODO: What about byte read/write?
-	// TODO: What about half read/write?
+	// Reads blocks * 64 bytes.  MUST be 4-byte-aligned.  No programmer has one
+	// yet; the ESP32-S2 firmware would need a block read command first.
+	int (*BlockRead64)( void * dev, uint32_t address_to_read, uint8_t * data, int blocks );
 
 	// Returns positive if received text.
 	// Returns negative if error.
@@ -57,9 +67,12 @@ struct MiniChlinkFunctions
 
 	int (*VendorCommand)( void * dev, const char * command );
 
-	// Do Not override these.  they are cursed.
+	// Narrow accesses, for registers that need them and unaligned edges.  Runs
+	// of sequential calls are streamed.  Half-words MUST be 2-byte-aligned.
 	int (*WriteHalfWord)( void * dev, uint32_t address_to_write, uint32_t data );
 	int (*ReadHalfWord)( void * dev, uint32_t address_to_read, uint32_t * data );
+	int (*WriteByte)( void * dev, uint32_t address_to_write, uint32_t data );
+	int (*ReadByte)( void * dev, uint32_t address_to_read, uint32_t * data );
 };
 
 /** If you are writing a driver, the minimal number of functions you can implement are:
@@ -71,6 +84,7 @@ struct MiniChlinkFunctions
 // Convert a 4-character string to an int.
 #define STTAG( x ) (*((uint32_t*)(x)))
 
+// Opaque outside of minichlink itself, see minichlink-internal.h.
 struct InternalState;
 
 struct ProgrammerStructBase
@@ -79,14 +93,9 @@ struct ProgrammerStructBase
 	// You can put other things here.
 };
 
-struct InternalState
-{
-	uint32_t statetag;
-	uint32_t currentstateval;
-	uint32_t flash_unlocked;
-	int lastwriteflags;
-	int processor_in_mode;
-};
+#define ERASE_OP_PAGE   0 // 64-byte fast page erase
+#define ERASE_OP_SECTOR 1 // 1kB sector erase
+#define ERASE_OP_MASS   2 // Whole user flash
 
 
 #define DMDATA0        0x04
@@ -110,17 +119,48 @@ struct InternalState
 #define DMCFGR       0x7D
 #define DMSHDWCFGR   0x7E
 
-extern struct MiniChlinkFunctions MCF;
-
-// Returns 'dev' on success, else 0.
-void * TryInit_WCHLinkE();
-void * TryInit_ESP32S2CHFUN();
-
 // Returns 0 if ok, populated, 1 if not populated.
 int SetupAutomaticHighLevelFunctions( void * dev );
 
 // Useful for converting numbers like 0x, etc.
 int64_t SimpleReadNumberInt( const char * number, int64_t defaultNumber );
 
+// Library interface (libminichlink).  Build with MINICHLINK_AS_LIBRARY to get
+// this without the command line front end.
+#if defined( MINICHLINK_AS_LIBRARY ) && ( defined(WINDOWS) || defined(WIN32) || defined(_WIN32) )
+#define DLLDECORATE __declspec(dllexport)
+#else
+#define DLLDECORATE
+#endif
+
+// Finds a supported programmer and sets it up.  Returns a handle, or 0.
+// selector is 0 or "" for the first one found, else "linke" or "esp32s2" for the
+// first of that kind, optionally followed by ":n" for the n'th (from 0).
+DLLDECORATE void * MiniChlinkOpen( const char * selector );
+// Calls the programmer's Exit, which releases its USB resources, and frees the handle.
+DLLDECORATE void MiniChlinkClose( void * dev );
+
+// These take the handle's lock for the duration of the call, flush any queued
+// commands before returning and return -1 if the programmer can't do it.
+DLLDECORATE int MiniChlinkSetupInterface( void * dev );
+DLLDECORATE int MiniChlinkHaltMode( void * dev, int mode );
+DLLDECORATE int MiniChlinkErase( void * dev, uint32_t address, uint32_t length, int type );
+DLLDECORATE int MiniChlinkWriteBinaryBlob( void * dev, uint32_t address_to_write, uint32_t blob_size, uint8_t * blob );
+DLLDECORATE int MiniChlinkReadBinaryBlob( void * dev, uint32_t address_to_read_from, uint32_t read_size, uint8_t * blob );
+
+// For anything else, use the function table directly, holding the lock.
+DLLDECORATE struct MiniChlinkFunctions * MiniChlinkGetFunctions( void * dev );
+DLLDECORATE void MiniChlinkLock( void * dev );
+DLLDECORATE void MiniChlinkUnlock( void * dev );
+
+// ELF helpers, for things like finding the trace buffer in a firmware image. (elfreader.c)
+struct ElfFile;
+struct ElfFile * ElfLoad( const char * fname );
+void ElfFree( struct ElfFile * e );
+// Returns 0 if found.
+int ElfFindSymbol( struct ElfFile * e, const char * name, uint32_t * value, uint32_t * size );
+// Returns pointer to the section contents inside the file, or 0 if not found.
+const uint8_t * ElfGetSection( struct ElfFile * e, const char * name, uint32_t * address, uint32_t * size );
+
 #endif
 
@@ -1,6 +1,6 @@
 #include <stdint.h>
 #include "hidapi.c"
-#include "minichlink.h"
+#include "minichlink-internal.h"
 
 struct ESP32ProgrammerStruct
 {
@@ -56,7 +56,7 @@ static int ESPWriteReg32( void * dev, uint8_t reg_7_bit, uint32_t value )
 //	printf( "WriteReg: %02x -> %08x\n", reg_7_bit, value );
 
 
-	if( SRemain( eps ) < 5 ) ESPFlushLLCommands( eps );
+	if( SRemain( eps ) < 5 && ESPFlushLLCommands( eps ) < 0 ) return -9;
 
 	Write1( eps, (reg_7_bit<<1) | 1 );
 	Write4LE( eps, value );
@@ -104,8 +104,10 @@ int ESPFlushLLCommands( void * dev )
 	eps->commandplace = 1;
 	if( r < 0 )
 	{
+		// Leave it to the caller to decide whether to re-attach and try again.
 		fprintf( stderr, "Error: Got error %d when sending hid feature report.\n", r );
-		exit( -9 );
+		eps->replylen = 0;
+		return r;
 	}
 retry:
 	eps->reply[0] = 0xad; // Key report ID
@@ -126,6 +128,7 @@ retry:
 	if( r < 0 )
 	{
 		fprintf( stderr, "Error: Got error %d when sending hid feature report.\n", r );
+		eps->replylen = 0;
 		return r;
 	}
 	eps->replylen = eps->reply[0] + 1; // Include the header byte.
@@ -137,8 +140,8 @@ int ESPControl3v3( void * dev, int bOn )
 {
 	struct ESP32ProgrammerStruct * eps = (struct ESP32ProgrammerStruct *)dev;
 
-	if( SRemain( eps ) < 2 )
-		ESPFlushLLCommands( eps );
+	if( SRemain( eps ) < 2 && ESPFlushLLCommands( eps ) < 0 )
+		return -9;
 
 	if( bOn )
 		Write2LE( eps, 0x03fe );
@@ -152,8 +155,8 @@ int ESPReadWord( void * dev, uint32_t address_to_read, uint32_t * data )
 {
 	struct ESP32ProgrammerStruct * eps = (struct ESP32ProgrammerStruct *)dev;
 //printf( "READ: %08x\n", address_to_read );
-	if( SRemain( eps ) < 6 )
-		ESPFlushLLCommands( eps );
+	if( SRemain( eps ) < 6 && ESPFlushLLCommands( eps ) < 0 )
+		return -9;
 
 	Write2LE( eps, 0x09fe );
 	Write4LE( eps, address_to_read );
@@ -176,8 +179,8 @@ int ESPWriteWord( void * dev, uint32_t address_to_write, uint32_t data )
 
 //printf( "WRITE: %08x\n", address_to_write );
 
-	if( SRemain( eps ) < 10 )
-		ESPFlushLLCommands( eps );
+	if( SRemain( eps ) < 10 && ESPFlushLLCommands( eps ) < 0 )
+		return -9;
 
 	Write2LE( eps, 0x08fe );
 	Write4LE( eps, address_to_write );	
@@ -188,8 +191,8 @@ int ESPWriteWord( void * dev, uint32_t address_to_write, uint32_t data )
 static int ESPDelayUS( void * dev, int microseconds )
 {
 	struct ESP32ProgrammerStruct * eps = (struct ESP32ProgrammerStruct *)dev;
-	if( SRemain( eps ) < 6 )
-		ESPFlushLLCommands( eps );
+	if( SRemain( eps ) < 6 && ESPFlushLLCommands( eps ) < 0 )
+		return -9;
 
 	Write2LE( eps, 0x04fe );
 	Write2LE( eps, microseconds );
@@ -200,8 +203,8 @@ static int ESPDelayUS( void * dev, int microseconds )
 static int ESPWaitForFlash( void * dev )
 {
 	struct ESP32ProgrammerStruct * eps = (struct ESP32ProgrammerStruct *)dev;
-	if( SRemain( eps ) < 2 )
-		ESPFlushLLCommands( eps );
+	if( SRemain( eps ) < 2 && ESPFlushLLCommands( eps ) < 0 )
+		return -9;
 	Write2LE( eps, 0x06fe );
 	return 0;
 }
@@ -209,8 +212,8 @@ static int ESPWaitForFlash( void * dev )
 static int ESPWaitForDoneOp( void * dev )
 {
 	struct ESP32ProgrammerStruct * eps = (struct ESP32ProgrammerStruct *)dev;
-	if( SRemain( eps ) < 2 )
-		ESPFlushLLCommands( dev );
+	if( SRemain( eps ) < 2 && ESPFlushLLCommands( dev ) < 0 )
+		return -9;
 	Write2LE( eps, 0x07fe );
 	return 0;
 }
@@ -234,7 +237,8 @@ int ESPBlockWrite64( void * dev, uint32_t address_to_write, uint8_t * data )
 	for( i = 0; i < 64; i++ ) Write1( eps, data[i] );
 	do
 	{
-		ESPFlushLLCommands( dev );
+		int r = ESPFlushLLCommands( dev );
+		if( r < 0 ) return r;
 	} while( eps->replylen < 2 );
 	return eps->reply[1];
 }
@@ -361,18 +365,29 @@ int ESPPollTerminal( void * dev, uint8_t * buffer, int maxlen, uint32_t leavefla
 }
 
 
-void * TryInit_ESP32S2CHFUN()
+void * TryInit_ESP32S2CHFUN( struct InternalState * iss, int index )
 {
 	#define VID 0x303a
 	#define PID 0x4004
 	hid_init();
-	hid_device * hd = hid_open( VID, PID, L"s2-ch32xx-pgm-v0"); // third parameter is "serial"
+	// Every programmer has the same "serial", so pick the index'th one with it.
+	hid_device * hd = 0;
+	struct hid_device_info * devs = hid_enumerate( VID, PID );
+	struct hid_device_info * cur;
+	for( cur = devs; cur && !hd; cur = cur->next )
+	{
+		if( cur->serial_number && wcscmp( cur->serial_number, L"s2-ch32xx-pgm-v0" ) == 0 && index-- == 0 )
+			hd = hid_open_path( cur->path );
+	}
+	hid_free_enumeration( devs );
 	if( !hd ) return 0;
 
 	struct ESP32ProgrammerStruct * eps = malloc( sizeof( struct ESP32ProgrammerStruct ) );
 	memset( eps, 0, sizeof( *eps ) );
 	eps->hd = hd;
 	eps->commandplace = 1;
+	eps->internal = iss;
+	void * dev = eps;
 
 	memset( &MCF, 0, sizeof( MCF ) );
 	MCF.WriteReg32 = ESPWriteReg32;
@@ -395,6 +410,14 @@ void * TryInit_ESP32S2CHFUN()
 
 	MCF.BlockWrite64 = ESPBlockWrite64;
 	MCF.VendorCommand = ESPVendorCommand;
+
+	// Every read is a full HID round trip, but it doesn't matter much whether
+	// it's a DMI register or a whole word.  A block write is one round trip.
+	iss->caps.flags = MCAP_BLOCK_WRITE64 | MCAP_QUEUED_DMI;
+	iss->caps.dmi_read_us = 1000;
+	iss->caps.word_read_us = 1000;
+	iss->caps.block_write_us = 2500;
+	iss->caps.page_write_us = 4000;
 	// Reset internal programmer state.
 	Write2LE( eps, 0x0afe );
 
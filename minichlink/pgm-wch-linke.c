@@ -7,17 +7,26 @@
 #include <stdio.h>
 #include <string.h>
 #include "libusb.h"
-#include "minichlink.h"
+#include "minichlink-internal.h"
 
 struct LinkEProgrammerStruct
 {
 	void * internal;
 	libusb_device_handle * devh;
+	libusb_context * ctx;
 	int lasthaltmode;
 };
 
+#if defined(WINDOWS) || defined(WIN32) || defined(_WIN32)
+#include <windows.h>
+static void LESleepMS( int ms ) { Sleep( ms ); }
+#else
+#include <unistd.h>
+static void LESleepMS( int ms ) { usleep( ms * 1000 ); }
+#endif
+
 #define WCHTIMEOUT 5000
-#define WCHCHECK(x) if( (status = x) ) { fprintf( stderr, "Bad USB Operation on " __FILE__ ":%d (%d)\n", __LINE__, status ); exit( status ); }
+#define WCHCHECK(x) if( (status = x) ) { fprintf( stderr, "Bad USB Operation on " __FILE__ ":%d (%d)\n", __LINE__, status ); return status; }
 
 const uint8_t * bootloader = (const uint8_t*)
 "\x21\x11\x22\xca\x26\xc8\x93\x77\x15\x00\x99\xcf\xb7\x06\x67\x45" \
@@ -55,7 +64,8 @@ const uint8_t * bootloader = (const uint8_t*)
 
 int bootloader_len = 512;
 
-void wch_link_command( libusb_device_handle * devh, const void * command_v, int commandlen, int * transferred, uint8_t * reply, int replymax )
+// Returns 0 if OK, else the (negative) libusb error.
+int wch_link_command( libusb_device_handle * devh, const void * command_v, int commandlen, int * transferred, uint8_t * reply, int replymax )
 {
 	uint8_t * command = (uint8_t*)command_v;
 	uint8_t buffer[1024];
@@ -74,7 +84,7 @@ void wch_link_command( libusb_device_handle * devh, const void * command_v, int
 	
 	status = libusb_bulk_transfer( devh, 0x81, reply, replymax, transferred, WCHTIMEOUT );
 	if( status ) goto sendfail;
-	return;
+	return 0;
 sendfail:
 	fprintf( stderr, "Error sending WCH command (%s): ", got_to_recv?"on recv":"on send" );
 	int i;
@@ -83,62 +93,80 @@ sendfail:
 		printf( "%02x ", command[i] );
 	}
 	printf( "\n" );
-	exit( status );
+	return status;
 }
 
-static void wch_link_multicommands( libusb_device_handle * devh, int nrcommands, ... )
+// Stops at the first command that fails, and returns its error.
+static int wch_link_multicommands( libusb_device_handle * devh, int nrcommands, ... )
 {
 	int i;
+	int r = 0;
 	va_list argp;
 	va_start(argp, nrcommands);
-	for( i = 0; i < nrcommands; i++ )
+	for( i = 0; i < nrcommands && !r; i++ )
 	{
 		int clen = va_arg(argp, int);
-		wch_link_command( devh, va_arg(argp, char *), clen, 0, 0, 0 );
+		r = wch_link_command( devh, va_arg(argp, char *), clen, 0, 0, 0 );
 	}
 	va_end( argp );
+	return r;
 }
 
-static inline libusb_device_handle * wch_link_base_setup( int inhibit_startup )
+// Opens the index'th LinkE.  On success, *pctx is the libusb context it was
+// opened in, which the caller has to libusb_exit once it's closed.
+static inline libusb_device_handle * wch_link_base_setup( int inhibit_startup, int index, libusb_context ** pctx )
 {
 	libusb_context * ctx = 0;
 	int status;
 	status = libusb_init(&ctx);
 	if (status < 0) {
 		fprintf( stderr, "Error: libusb_init_context() returned %d\n", status );
-		exit( status );
+		return 0;
 	}
 	
 	libusb_device **list;
 	libusb_device *found = NULL;
 	ssize_t cnt = libusb_get_device_list(ctx, &list);
 	ssize_t i = 0;
-	for (i = 0; i < cnt; i++) {
+	for (i = 0; i < cnt && !found; i++) {
 		libusb_device *device = list[i];
 		struct libusb_device_descriptor desc;
 		int r = libusb_get_device_descriptor(device,&desc);
-		if( r == 0 && desc.idVendor == 0x1a86 && desc.idProduct == 0x8010 ) { found = device; }
+		if( r == 0 && desc.idVendor == 0x1a86 && desc.idProduct == 0x8010 && index-- == 0 ) { found = device; }
 	}
 
-	if( !found )
+	libusb_device_handle * devh = 0;
+	if( found )
+	{
+		status = libusb_open( found, &devh );
+		if( status )
+		{
+			fprintf( stderr, "Error: couldn't open wch link device (libusb_open() = %d)\n", status );
+			devh = 0;
+		}
+	}
+	if( cnt >= 0 )
+		libusb_free_device_list( list, 1 ); // devh keeps its own reference.
+	if( !devh )
 	{
+		libusb_exit( ctx );
 		return 0;
 	}
 
-	libusb_device_handle * devh;
-	status = libusb_open( found, &devh );
+	status = libusb_claim_interface(devh, 0);
 	if( status )
 	{
-		fprintf( stderr, "Error: couldn't open wch link device (libusb_open() = %d)\n", status );
+		fprintf( stderr, "Error: couldn't claim wch link interface (%d)\n", status );
+		libusb_close( devh );
+		libusb_exit( ctx );
 		return 0;
 	}
-		
-	WCHCHECK( libusb_claim_interface(devh, 0) );
 	
 	uint8_t rbuff[1024];
 	int transferred;
 	libusb_bulk_transfer( devh, 0x81, rbuff, 1024, &transferred, 1 ); // Clear out any pending transfers.  Don't wait though.
 
+	*pctx = ctx;
 	return devh;
 }
 
@@ -148,16 +176,30 @@ static int LESetupInterface( void * d )
 	uint8_t rbuff[1024];
 	uint32_t transferred = 0;
 
+	int r = 0;
+
 	// Place part into reset.
-	wch_link_command( dev, "\x81\x0d\x01\x01", 4, (int*)&transferred, rbuff, 1024 );	// Reply is: "\x82\x0d\x04\x02\x08\x02\x00"
+	r |= wch_link_command( dev, "\x81\x0d\x01\x01", 4, (int*)&transferred, rbuff, 1024 );	// Reply is: "\x82\x0d\x04\x02\x08\x02\x00"
 
 	// TODO: What in the world is this?  It doesn't appear to be needed.
-	wch_link_command( dev, "\x81\x0c\x02\x09\x01", 5, 0, 0, 0 ); //Reply is: 820c0101
+	r |= wch_link_command( dev, "\x81\x0c\x02\x09\x01", 5, 0, 0, 0 ); //Reply is: 820c0101
 
 	// This puts the processor on hold to allow the debugger to run.
-	wch_link_command( dev, "\x81\x0d\x01\x02", 4, 0, 0, 0 ); // Reply: Ignored, 820d050900300500
-
-	wch_link_command( dev, "\x81\x11\x01\x09", 4, (int*)&transferred, rbuff, 1024 ); // Reply: Chip ID + Other data (see below)
+	r |= wch_link_command( dev, "\x81\x0d\x01\x02", 4, 0, 0, 0 ); // Reply: Ignored, 820d050900300500
+	if( r ) return -1;
+
+	// The part may take a moment to come out of reset.  Ask again rather than bail,
+	// waiting a little longer each time.
+	int tries;
+	int backoff_ms = 1;
+	for( tries = 0; tries < 10; tries++ )
+	{
+		transferred = 0;
+		wch_link_command( dev, "\x81\x11\x01\x09", 4, (int*)&transferred, rbuff, 1024 ); // Reply: Chip ID + Other data (see below)
+		if( transferred == 20 ) break;
+		LESleepMS( backoff_ms );
+		if( backoff_ms < 8 ) backoff_ms *= 2;
+	}
 	if( transferred != 20 )
 	{
 		fprintf( stderr, "Error: could not get part status\n" );
@@ -175,10 +217,9 @@ static int LEControl3v3( void * d, int bOn )
 	libusb_device_handle * dev = ((struct LinkEProgrammerStruct*)d)->devh;
 printf( "3v3: %d\n", bOn );
 	if( bOn )
-		wch_link_command( (libusb_device_handle *)dev, "\x81\x0d\x01\x09", 4, 0, 0, 0 );
+		return wch_link_command( (libusb_device_handle *)dev, "\x81\x0d\x01\x09", 4, 0, 0, 0 );
 	else
-		wch_link_command( (libusb_device_handle *)dev, "\x81\x0d\x01\x09", 4, 0, 0, 0 );
-	return 0;
+		return wch_link_command( (libusb_device_handle *)dev, "\x81\x0d\x01\x09", 4, 0, 0, 0 );
 }
 
 static int LEControl5v( void * d, int bOn )
@@ -187,44 +228,46 @@ static int LEControl5v( void * d, int bOn )
 printf( "  5: %d\n", bOn );
 
 	if( bOn )
-		wch_link_command( (libusb_device_handle *)dev, "\x81\x0d\x01\x0b", 4, 0, 0, 0 );
+		return wch_link_command( (libusb_device_handle *)dev, "\x81\x0d\x01\x0b", 4, 0, 0, 0 );
 	else
-		wch_link_command( (libusb_device_handle *)dev, "\x81\x0d\x01\x0c", 4, 0, 0, 0 );
-	return 0;
+		return wch_link_command( (libusb_device_handle *)dev, "\x81\x0d\x01\x0c", 4, 0, 0, 0 );
 }
 
 static int LEUnbrick( void * d )
 {
 	printf( "Sending unbrick\n" );
 	libusb_device_handle * dev = ((struct LinkEProgrammerStruct*)d)->devh;
-	wch_link_command( (libusb_device_handle *)dev, "\x81\x0d\x01\x0f\x09", 5, 0, 0, 0 );
+	int r = wch_link_command( (libusb_device_handle *)dev, "\x81\x0d\x01\x0f\x09", 5, 0, 0, 0 );
 	printf( "Done unbrick\n" );
-	return 0;
+	return r;
 }
 
 static int LEHaltMode( void * d, int mode )
 {
 	libusb_device_handle * dev = ((struct LinkEProgrammerStruct*)d)->devh;
+	int r;
 	if( mode == ((struct LinkEProgrammerStruct*)d)->lasthaltmode )
 		return 0;
-	((struct LinkEProgrammerStruct*)d)->lasthaltmode = mode;
 	
 	if( mode == 0 )
 	{
 		printf( "Holding in reset\n" );
 		// Part one "immediately" places the part into reset.  Part 2 says when we're done, leave part in reset.
-		wch_link_multicommands( (libusb_device_handle *)dev, 2, 4, "\x81\x0d\x01\x02", 4, "\x81\x0d\x01\x01" );
+		r = wch_link_multicommands( (libusb_device_handle *)dev, 2, 4, "\x81\x0d\x01\x02", 4, "\x81\x0d\x01\x01" );
 	}
 	else if( mode == 1 )
 	{
 		// This is clearly not the "best" method to exit reset.  I don't know why this combination works.
-		wch_link_multicommands( (libusb_device_handle *)dev, 3, 4, "\x81\x0b\x01\x01", 4, "\x81\x0d\x01\x02", 4, "\x81\x0d\x01\xff" );
+		r = wch_link_multicommands( (libusb_device_handle *)dev, 3, 4, "\x81\x0b\x01\x01", 4, "\x81\x0d\x01\x02", 4, "\x81\x0d\x01\xff" );
 	}
 	else
 	{
 		return -93;
 	}
-	return 0;
+	// Only remember the mode if we really got there, so a retry does it again.
+	if( r == 0 )
+		((struct LinkEProgrammerStruct*)d)->lasthaltmode = mode;
+	return r;
 }
 
 static int LEConfigureNRSTAsGPIO( void * d, int one_if_yes_gpio )
@@ -233,13 +276,12 @@ static int LEConfigureNRSTAsGPIO( void * d, int one_if_yes_gpio )
 
 	if( one_if_yes_gpio )
 	{
-		wch_link_multicommands( (libusb_device_handle *)dev, 2, 11, "\x81\x06\x08\x02\xff\xff\xff\xff\xff\xff\xff", 4, "\x81\x0b\x01\x01" );
+		return wch_link_multicommands( (libusb_device_handle *)dev, 2, 11, "\x81\x06\x08\x02\xff\xff\xff\xff\xff\xff\xff", 4, "\x81\x0b\x01\x01" );
 	}
 	else
 	{
-		wch_link_multicommands( (libusb_device_handle *)dev, 2, 11, "\x81\x06\x08\x02\xf7\xff\xff\xff\xff\xff\xff", 4, "\x81\x0b\x01\x01" );
+		return wch_link_multicommands( (libusb_device_handle *)dev, 2, 11, "\x81\x06\x08\x02\xf7\xff\xff\xff\xff\xff\xff", 4, "\x81\x0b\x01\x01" );
 	}
-	return 0;
 }
 
 
@@ -247,15 +289,14 @@ static int LEReadBinaryBlob( void * d, uint32_t offset, uint32_t amount, uint8_t
 {
 	libusb_device_handle * dev = ((struct LinkEProgrammerStruct*)d)->devh;
 
-	LEHaltMode( d, 0 );
-
 	int i;
 	int status;
 	uint8_t rbuff[1024];
 	int transferred = 0;
 	int readbuffplace = 0;
 
-	wch_link_command( (libusb_device_handle *)dev, "\x81\x06\x01\x01", 4, 0, 0, 0 );
+	if( ( status = LEHaltMode( d, 0 ) ) ) return status;
+	WCHCHECK( wch_link_command( (libusb_device_handle *)dev, "\x81\x06\x01\x01", 4, 0, 0, 0 ) );
 
 	// Flush out any pending data.
 	libusb_bulk_transfer( (libusb_device_handle *)dev, 0x82, rbuff, 1024, &transferred, 1 );
@@ -275,10 +316,10 @@ static int LEReadBinaryBlob( void * d, uint32_t offset, uint32_t amount, uint8_t
 	readop[9] = (amount>>8)&0xff;
 	readop[10] = (amount>>0)&0xff;
 	
-	wch_link_command( (libusb_device_handle *)dev, readop, 11, 0, 0, 0 );
+	WCHCHECK( wch_link_command( (libusb_device_handle *)dev, readop, 11, 0, 0, 0 ) );
 
 	// Perform operation
-	wch_link_command( (libusb_device_handle *)dev, "\x81\x02\x01\x0c", 4, 0, 0, 0 );
+	WCHCHECK( wch_link_command( (libusb_device_handle *)dev, "\x81\x02\x01\x0c", 4, 0, 0, 0 ) );
 
 	uint32_t remain = amount;
 	while( remain )
@@ -305,8 +346,6 @@ static int LEWriteBinaryBlob( void * d, uint32_t address_to_write, uint32_t len,
 {
 	libusb_device_handle * dev = ((struct LinkEProgrammerStruct*)d)->devh;
 
-	LEHaltMode( d, 0 );
-
 	int i;
 	int status;
 	uint8_t rbuff[1024];
@@ -314,17 +353,18 @@ static int LEWriteBinaryBlob( void * d, uint32_t address_to_write, uint32_t len,
 
 	int padlen = ((len-1) & (~0x3f)) + 0x40;
 
-	wch_link_command( (libusb_device_handle *)dev, "\x81\x06\x01\x01", 4, 0, 0, 0 );
-	wch_link_command( (libusb_device_handle *)dev, "\x81\x06\x01\x01", 4, 0, 0, 0 ); // Not sure why but it seems to work better when we request twice.
+	if( ( status = LEHaltMode( d, 0 ) ) ) return status;
+	WCHCHECK( wch_link_command( (libusb_device_handle *)dev, "\x81\x06\x01\x01", 4, 0, 0, 0 ) );
+	WCHCHECK( wch_link_command( (libusb_device_handle *)dev, "\x81\x06\x01\x01", 4, 0, 0, 0 ) ); // Not sure why but it seems to work better when we request twice.
 
 	// This contains the write data quantity, in bytes.  (The last 2 octets)
 	// Then it just rollllls on in.
 	char rksbuff[11] = { 0x81, 0x01, 0x08, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
 	rksbuff[9] = len >> 8;
 	rksbuff[10] = len & 0xff;
-	wch_link_command( (libusb_device_handle *)dev, rksbuff, 11, 0, 0, 0 );
+	WCHCHECK( wch_link_command( (libusb_device_handle *)dev, rksbuff, 11, 0, 0, 0 ) );
 	
-	wch_link_command( (libusb_device_handle *)dev, "\x81\x02\x01\x05", 4, 0, 0, 0 );
+	WCHCHECK( wch_link_command( (libusb_device_handle *)dev, "\x81\x02\x01\x05", 4, 0, 0, 0 ) );
 	
 	int pplace = 0;
 	for( pplace = 0; pplace < bootloader_len; pplace += 64 )
@@ -334,7 +374,7 @@ static int LEWriteBinaryBlob( void * d, uint32_t address_to_write, uint32_t len,
 	
 	for( i = 0; i < 10; i++ )
 	{
-		wch_link_command( (libusb_device_handle *)dev, "\x81\x02\x01\x07", 4, &transferred, rbuff, 1024 );
+		WCHCHECK( wch_link_command( (libusb_device_handle *)dev, "\x81\x02\x01\x07", 4, &transferred, rbuff, 1024 ) );
 		if( transferred == 4 && rbuff[0] == 0x82 && rbuff[1] == 0x02 && rbuff[2] == 0x01 && rbuff[3] == 0x07 )
 		{
 			break;
@@ -343,10 +383,10 @@ static int LEWriteBinaryBlob( void * d, uint32_t address_to_write, uint32_t len,
 	if( i == 10 )
 	{
 		fprintf( stderr, "Error, confusing respones to 02/01/07\n" );
-		exit( -109 );
+		return -109;
 	}
 	
-	wch_link_command( (libusb_device_handle *)dev, "\x81\x02\x01\x02", 4, 0, 0, 0 );
+	WCHCHECK( wch_link_command( (libusb_device_handle *)dev, "\x81\x02\x01\x02", 4, 0, 0, 0 ) );
 
 	for( pplace = 0; pplace < padlen; pplace += 64 )
 	{
@@ -369,23 +409,30 @@ static int LEWriteBinaryBlob( void * d, uint32_t address_to_write, uint32_t len,
 
 int LEExit( void * d )
 {
-	libusb_device_handle * dev = ((struct LinkEProgrammerStruct*)d)->devh;
-
-	wch_link_command( (libusb_device_handle *)dev, "\x81\x0d\x01\xff", 4, 0, 0, 0);
-	return 0;
+	struct LinkEProgrammerStruct * eps = (struct LinkEProgrammerStruct*)d;
+	int r = wch_link_command( eps->devh, "\x81\x0d\x01\xff", 4, 0, 0, 0);
+	libusb_release_interface( eps->devh, 0 );
+	libusb_close( eps->devh );
+	libusb_exit( eps->ctx );
+	free( eps );
+	return r;
 }
 
-void * TryInit_WCHLinkE()
+void * TryInit_WCHLinkE( struct InternalState * iss, int index )
 {
 	libusb_device_handle * wch_linke_devh;
-	wch_linke_devh = wch_link_base_setup(0);
+	libusb_context * ctx = 0;
+	wch_linke_devh = wch_link_base_setup( 0, index, &ctx );
 	if( !wch_linke_devh ) return 0;
 
 
 	struct LinkEProgrammerStruct * ret = malloc( sizeof( struct LinkEProgrammerStruct ) );
 	memset( ret, 0, sizeof( *ret ) );
 	ret->devh = wch_linke_devh;
+	ret->ctx = ctx;
 	ret->lasthaltmode = 0;
+	ret->internal = iss;
+	void * dev = ret;
 
 	MCF.WriteReg32 = 0;
 	MCF.ReadReg32 = 0;
@@ -399,6 +446,8 @@ void * TryInit_WCHLinkE()
 	MCF.WriteBinaryBlob = LEWriteBinaryBlob;
 	MCF.ReadBinaryBlob = LEReadBinaryBlob;
 	MCF.Exit = LEExit;
+
+	iss->caps.flags = MCAP_BLOCK_READ; // Blobs are all done by the LinkE itself.
 	return ret;
 };
 
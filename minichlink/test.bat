@@ -1 +1 @@
-tcc -lsetupapi minichlink.c libusb-1.0.dll pgm-esp32s2-ch32xx.c  pgm-wch-linke.c
+tcc -lsetupapi minichlink.c libusb-1.0.dll pgm-esp32s2-ch32xx.c  pgm-wch-linke.c elfreader.c
@@ -0,0 +1,107 @@
+// Checks ch32v003fun.c's memcpy, memset and memmove against the host's libc,
+// over every alignment of source and destination within two words, lengths
+// either side of the unrolled and word loops, and overlaps in both directions.
+// Bytes around the destination have to come through untouched.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+void * fun_memcpy( void * dest, const void * src, size_t n );
+void * fun_memset( void * dest, int c, size_t n );
+void * fun_memmove( void * dest, const void * src, size_t n );
+
+#define BUFSIZE 1536
+#define BASE 64 // Room in front, to underrun into.
+
+static uint8_t got[BUFSIZE];
+static uint8_t want[BUFSIZE];
+static uint8_t source[BUFSIZE];
+static int checks, failures;
+
+static const int lengths[] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 11, 12, 13, 15, 16, 17, 19, 20, 23, 24, 31, 32, 33, 47, 48, 63, 64, 65, 100, 255, 256, 1023 };
+#define NLENGTHS ( sizeof( lengths ) / sizeof( lengths[0] ) )
+
+static void Fill( uint8_t * buf, uint32_t seed )
+{
+	int i;
+	for( i = 0; i < BUFSIZE; i++ )
+	{
+		seed = seed * 1103515245 + 12345;
+		buf[i] = seed >> 16;
+	}
+}
+
+static void Check( const char * fn, int ok, int dalign, int salign, int len )
+{
+	checks++;
+	if( ok ) return;
+	if( failures++ < 20 )
+		printf( "FAIL: %s dest+%d src+%d len %d\n", fn, dalign, salign, len );
+}
+
+static void TestMemcpy()
+{
+	int d, s;
+	unsigned l;
+	for( d = 0; d < 8; d++ )
+	for( s = 0; s < 8; s++ )
+	for( l = 0; l < NLENGTHS; l++ )
+	{
+		int len = lengths[l];
+		Fill( source, d * 64 + s * 8 + l );
+		Fill( got, len );
+		memcpy( want, got, BUFSIZE );
+		void * r = fun_memcpy( got + BASE + d, source + s, len );
+		memcpy( want + BASE + d, source + s, len );
+		Check( "memcpy", r == got + BASE + d && memcmp( got, want, BUFSIZE ) == 0, d, s, len );
+	}
+}
+
+static void TestMemset()
+{
+	static const int values[] = { 0, 0xa5, 0xff, 0x1ff, -1 }; // Only the low byte counts.
+	int d, v;
+	unsigned l;
+	for( d = 0; d < 8; d++ )
+	for( v = 0; v < 5; v++ )
+	for( l = 0; l < NLENGTHS; l++ )
+	{
+		int len = lengths[l];
+		Fill( got, d * 5 + v );
+		memcpy( want, got, BUFSIZE );
+		void * r = fun_memset( got + BASE + d, values[v], len );
+		memset( want + BASE + d, values[v], len );
+		Check( "memset", r == got + BASE + d && memcmp( got, want, BUFSIZE ) == 0, d, v, len );
+	}
+}
+
+// Source and destination in the same buffer, from well apart to fully
+// overlapping, with the destination above and below.
+static void TestMemmove()
+{
+	int s, delta;
+	unsigned l;
+	for( s = 0; s < 8; s++ )
+	for( delta = -70; delta <= 70; delta++ )
+	for( l = 0; l < NLENGTHS; l++ )
+	{
+		int len = lengths[l];
+		int src = BASE + 128 + s;
+		if( src + delta + len > BUFSIZE - BASE || src + len > BUFSIZE - BASE ) continue;
+		Fill( got, s * 141 + delta + l );
+		memcpy( want, got, BUFSIZE );
+		void * r = fun_memmove( got + src + delta, got + src, len );
+		memmove( want + src + delta, want + src, len );
+		Check( "memmove", r == got + src + delta && memcmp( got, want, BUFSIZE ) == 0, ( src + delta ) & 7, s, len );
+	}
+}
+
+int main( int argc, char ** argv )
+{
+	TestMemcpy();
+	TestMemset();
+	TestMemmove();
+	printf( "%s: %d checks, %d failures\n", argv[0], checks, failures );
+	return failures != 0;
+}
@@ -0,0 +1,132 @@
+// Drives minichlink's DefaultWriteBinaryBlob and InternalWriteWithResume
+// against a model of the CH32V003's flash controller, with the link failing
+// partway through a write, and checks nothing outside the blob is lost once
+// the write has been resumed.  Half the writes verify, with one page program
+// going bad, which has to be caught and rewritten.  Blobs start anywhere and are any length, so the
+// first and last pages are usually only partly covered.
+
+#define main minichlink_main
+#include "../minichlink/minichlink.c"
+#undef main
+
+#include <unistd.h>
+
+#define MODEL_FLASH 0x08000000
+
+static uint8_t flash[MAIN_FLASH_SIZE];
+static uint8_t staged[64];
+static uint32_t flash_addr;
+static int programs_left; // Page programs until the link "drops", -1 for never.
+static int corrupt_left;  // Page programs until one goes wrong, -1 for never.
+static int checks, failures;
+
+// Main flash reads and the page buffer, plus enough of FLASH->CTLR and
+// FLASH->ADDR to erase and program pages.
+static int ModelReadWord( void * dev, uint32_t address, uint32_t * data )
+{
+	if( address >= MODEL_FLASH && address < MODEL_FLASH + MAIN_FLASH_SIZE )
+		memcpy( data, flash + ( address - MODEL_FLASH ), 4 );
+	else
+		*data = 0;
+	return 0;
+}
+
+static int ModelWriteWord( void * dev, uint32_t address, uint32_t data )
+{
+	if( address >= MODEL_FLASH && address < MODEL_FLASH + MAIN_FLASH_SIZE )
+		memcpy( staged + ( address & 63 ), &data, 4 );
+	else if( address == 0x40022014 )
+		flash_addr = data;
+	else if( address == 0x40022010 && ( data & CR_STRT_Set ) )
+	{
+		uint32_t o = flash_addr - MODEL_FLASH;
+		int i;
+		if( data & CR_PAGE_ER )
+			memset( flash + ( o & ~63 ), 0xff, 64 );
+		else if( data & CR_PER_Set )
+			memset( flash + ( o & ~1023 ), 0xff, 1024 );
+		else if( data & FLASH_CTLR_MER )
+			memset( flash, 0xff, MAIN_FLASH_SIZE );
+		else if( data & CR_PAGE_PG )
+		{
+			if( programs_left == 0 )
+			{
+				programs_left = -1;
+				return -1; // Link dropped.  Only once.
+			}
+			if( programs_left > 0 ) programs_left--;
+			for( i = 0; i < 64; i++ )
+				flash[( o & ~63 ) + i] &= staged[i];
+			if( corrupt_left == 0 )
+				flash[( o & ~63 ) + 5] &= 0x7e; // Verify should catch this.
+			if( corrupt_left >= 0 ) corrupt_left--;
+		}
+	}
+	return 0;
+}
+
+static int ModelWriteReg32( void * dev, uint8_t reg_7_bit, uint32_t value ) { return 0; }
+static int ModelReadReg32( void * dev, uint8_t reg_7_bit, uint32_t * value ) { *value = 0; return 0; }
+static int ModelNop( void * dev ) { return 0; }
+
+void * TryInit_WCHLinkE( struct InternalState * iss, int index ) { return 0; }
+void * TryInit_ESP32S2CHFUN( struct InternalState * iss, int index ) { return 0; }
+
+int main( int argc, char ** argv )
+{
+	static uint8_t want[MAIN_FLASH_SIZE];
+	static uint8_t blob[MAIN_FLASH_SIZE];
+	struct InternalState is = { 0 };
+	struct ProgrammerStructBase pb = { &is };
+	void * dev = &pb;
+	uint32_t seed = 1;
+	int t;
+
+	// minichlink narrates every erase and retry; only our results are wanted.
+	FILE * report = fdopen( dup( 1 ), "w" );
+	freopen( "/dev/null", "w", stdout );
+	freopen( "/dev/null", "w", stderr );
+
+	MCF.WriteReg32 = ModelWriteReg32;
+	MCF.ReadReg32 = ModelReadReg32;
+	MCF.ReadWord = ModelReadWord;
+	MCF.WriteWord = ModelWriteWord;
+	MCF.WaitForFlash = ModelNop;
+	MCF.FlushLLCommands = ModelNop;
+	MCF.SetupInterface = ModelNop;
+	is.caps.dmi_read_us = 100;
+	is.caps.word_read_us = 10;
+	SetupAutomaticHighLevelFunctions( dev );
+
+	for( t = 0; t < 400; t++ )
+	{
+		int i;
+		for( i = 0; i < MAIN_FLASH_SIZE; i++ )
+		{
+			seed = seed * 1103515245 + 12345;
+			flash[i] = want[i] = seed >> 16;
+		}
+		seed = seed * 1103515245 + 12345;
+		uint32_t address = ( seed >> 8 ) % ( MAIN_FLASH_SIZE - 1024 );
+		seed = seed * 1103515245 + 12345;
+		uint32_t len = 1 + ( seed >> 8 ) % 600;
+		if( t % 4 == 0 ) len = ( len + 63 ) & ~63; // Some whole-page lengths too.
+		uint32_t pages = ( ( address + len + 63 ) & ~63 ) / 64 - address / 64;
+		for( i = 0; i < len; i++ )
+			blob[i] = want[address + i] = i * 7 + t;
+
+		programs_left = t % ( pages + 1 ); // pages means it never fails.
+		is.verify_writes = t & 1;
+		corrupt_left = is.verify_writes ? ( t / 2 ) % pages : -1;
+		is.flash_unlocked = 1;
+		int r = InternalWriteWithResume( dev, MODEL_FLASH + address, len, blob );
+		checks++;
+		if( r || memcmp( flash, want, MAIN_FLASH_SIZE ) )
+		{
+			if( failures++ < 20 )
+				fprintf( report, "FAIL: address %04x len %d, failed after %d of %d pages, r = %d\n", address, len, t % ( pages + 1 ), pages, r );
+		}
+	}
+	fprintf( report, "%s: %d checks, %d failures\n", argv[0], checks, failures );
+	return failures != 0;
+}
@@ -0,0 +1,125 @@
+// Checks ch32v003fun.c's word-at-a-time scanners, strlen, strnlen, strchr and
+// memchr, against the host's libc.  Every start alignment within two words,
+// with the terminator or the byte being looked for in every lane of the words
+// that follow, and nowhere at all.  The filler is mostly bytes like 0x80 and
+// 0x01 that sit right next to the ones being looked for.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+size_t fun_strlen( const char * s );
+size_t fun_strnlen( const char * s, size_t n );
+char * fun_strchr( const char * s, int c );
+void * fun_memchr( const void * src, int c, size_t n );
+
+#define BUFSIZE 256
+#define MAXLEN 72
+
+// Kept 8-aligned, so buf + start has the alignment we asked for.
+static uint64_t storage[BUFSIZE / 8];
+static char * const buf = (char *)storage;
+static int checks, failures;
+
+static const uint8_t targets[] = { 0x01, 0x7f, 0x80, 0xfe, 0xff, 'a' };
+#define NTARGETS ( sizeof( targets ) / sizeof( targets[0] ) )
+
+// Nothing that is avoid, or 0.
+static void Fill( uint8_t avoid, uint32_t seed )
+{
+	static const uint8_t near[] = { 0x01, 0x02, 0x7f, 0x80, 0x81, 0xfe, 0xff, 0x61, 0x60 };
+	int i;
+	for( i = 0; i < BUFSIZE; i++ )
+	{
+		uint8_t b;
+		do
+		{
+			seed = seed * 1103515245 + 12345;
+			b = ( seed & 0x10000 ) ? near[( seed >> 17 ) % sizeof( near )] : seed >> 24;
+		} while( b == 0 || b == avoid );
+		buf[i] = b;
+	}
+}
+
+static void Check( const char * fn, int ok, int start, int len, int c )
+{
+	checks++;
+	if( ok ) return;
+	if( failures++ < 20 )
+		printf( "FAIL: %s start+%d len %d c %02x\n", fn, start, len, c );
+}
+
+static void TestStrlen()
+{
+	int start, len;
+	for( start = 0; start < 8; start++ )
+	for( len = 0; len < MAXLEN; len++ )
+	{
+		char * s = buf + 8 + start;
+		size_t n;
+		Fill( 0, start * MAXLEN + len );
+		s[len] = 0;
+		Check( "strlen", fun_strlen( s ) == len, start, len, 0 );
+		for( n = len > 5 ? len - 5 : 0; n < len + 5; n++ )
+			Check( "strnlen", fun_strnlen( s, n ) == strnlen( s, n ), start, len, (int)n );
+	}
+}
+
+// The target at every position up to len, then not there at all.  c also goes
+// in with junk above the low byte, which has to be ignored.
+static void TestStrchr()
+{
+	int start, len, pos;
+	unsigned t;
+	for( start = 0; start < 8; start++ )
+	for( t = 0; t < NTARGETS; t++ )
+	for( len = 0; len < MAXLEN; len++ )
+	for( pos = 0; pos <= len + 1; pos++ )
+	{
+		char * s = buf + 8 + start;
+		int c = targets[t];
+		Fill( c, start + t * 8 + len * 64 );
+		s[len] = 0;
+		if( pos < len ) s[pos] = c;
+		Check( "strchr", fun_strchr( s, c ) == strchr( s, c ), start, len, c );
+		Check( "strchr", fun_strchr( s, c | 0x300 ) == strchr( s, c ), start, len, c | 0x300 );
+	}
+	// Looking for the terminator finds it.
+	for( start = 0; start < 8; start++ )
+	for( len = 0; len < MAXLEN; len++ )
+	{
+		char * s = buf + 8 + start;
+		Fill( 0, start + len );
+		s[len] = 0;
+		Check( "strchr", fun_strchr( s, 0 ) == s + len, start, len, 0 );
+	}
+}
+
+// memchr doesn't stop at a 0, and must not find the target just past n.
+static void TestMemchr()
+{
+	int start, n, pos;
+	unsigned t;
+	for( start = 0; start < 8; start++ )
+	for( t = 0; t < NTARGETS + 1; t++ )
+	for( n = 0; n < MAXLEN; n++ )
+	for( pos = 0; pos <= n + 1; pos++ )
+	{
+		char * s = buf + 8 + start;
+		int c = ( t < NTARGETS ) ? targets[t] : 0;
+		Fill( c, start + t * 8 + n * 64 );
+		if( c ) s[n / 2] = 0;
+		s[pos] = c;
+		Check( "memchr", fun_memchr( s, c, n ) == memchr( s, c, n ), start, n, c );
+		Check( "memchr", fun_memchr( s, c | 0x300, n ) == memchr( s, c, n ), start, n, c | 0x300 );
+	}
+}
+
+int main( int argc, char ** argv )
+{
+	TestStrlen();
+	TestStrchr();
+	TestMemchr();
+	printf( "%s: %d checks, %d failures\n", argv[0], checks, failures );
+	return failures != 0;
+}